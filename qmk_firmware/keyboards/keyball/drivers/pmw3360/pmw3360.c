@@ -22,50 +22,360 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "srom_0x04.c"
 #include "srom_0x81.c"
 
+#if defined(__AVR__)
+#    include <avr/interrupt.h>
+#    include "timer_avr.h"
+#endif
+
 #define PMW3360_SPI_MODE 3
 #define PMW3360_SPI_DIVISOR (F_CPU / PMW3360_CLOCKS)
 #define PMW3360_CLOCKS 2000000
 
-static bool motion_bursting = false;
+// Timings in microseconds, from the PMW3360DM-T2QU datasheet.
+#define PMW3360_tSRAD 160     // address to data for register read.
+#define PMW3360_tSCLK_NCS_W 35 // last data byte to NCS rise for write.
+#define PMW3360_tSWW 145      // NCS rise to next access, after write.
+#define PMW3360_tSRR 20       // NCS rise to next access, after read.
+
+#if defined(__AVR__)
+// Resolution of pmw3360_timer_us(): a tick of TIMER_RAW.
+#    define PMW3360_TIMER_RESOLUTION (1000 / TIMER_RAW_TOP + 1)
+#else
+#    define PMW3360_TIMER_RESOLUTION 1000
+#endif
+
+static volatile bool motion_bursting = false;
+
+// burst_wanted is set by the sampler when motion burst mode must be started.
+// The sampler can't block for the write, so pmw3360_task() queues it.
+static volatile bool burst_wanted = false;
+
+// spi_busy is true while pmw3360_task() is using SPI or changing its state.
+// The sampler doesn't touch the sensor while this is true.
+static volatile bool spi_busy = false;
+
+// spi_claim marks SPI as busy for a blocking access from the main loop, and
+// returns the previous mark to be given back to spi_release().  The sampler
+// interrupt can't preempt in the middle of such an access then.
+static bool spi_claim(void) {
+    bool prev = spi_busy;
+    spi_busy  = true;
+    return prev;
+}
+
+static void spi_release(bool prev) {
+    spi_busy = prev;
+}
 
 bool pmw3360_spi_start(void) {
     return spi_start(PMW3360_NCS_PIN, false, PMW3360_SPI_MODE, PMW3360_SPI_DIVISOR);
 }
 
+uint32_t pmw3360_timer_us(void) {
+#if defined(__AVR__)
+    // Combine milliseconds counter and raw counter of timer0, reading both
+    // with interrupts masked.  When the caller has already masked them, the
+    // raw counter may have wrapped while the milliseconds interrupt is still
+    // pending.  Count that millisecond here, or the time goes backwards.
+    // Timer0 runs in CTC mode, so the pending wrap is OCF0A, not TOV0.
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t ms  = timer_read32();
+    uint8_t  raw = TIMER_RAW;
+    if (TIFR0 & _BV(OCF0A)) {
+        // Read again, the wrap may have happened just after the first read.
+        ms++;
+        raw = TIMER_RAW;
+    }
+    SREG = sreg;
+    return ms * 1000 + (uint32_t)raw * 1000 / TIMER_RAW_TOP;
+#else
+    return timer_read32() * 1000;
+#endif
+}
+
 uint8_t pmw3360_reg_read(uint8_t addr) {
+    bool busy = spi_claim();
     pmw3360_spi_start();
     spi_write(addr & 0x7f);
-    wait_us(160);
+    wait_us(PMW3360_tSRAD);
     uint8_t data = spi_read();
     wait_us(1);
     spi_stop();
-    wait_us(19);
+    wait_us(PMW3360_tSRR - 1);
     // Reset motion_bursting mode if read from a register other than motion
     // burst register.
     if (addr != pmw3360_Motion_Burst) {
         motion_bursting = false;
     }
+    spi_release(busy);
     return data;
 }
 
 void pmw3360_reg_write(uint8_t addr, uint8_t data) {
+    bool busy = spi_claim();
     pmw3360_spi_start();
     spi_write(addr | 0x80);
     spi_write(data);
-    wait_us(35);
+    wait_us(PMW3360_tSCLK_NCS_W);
     spi_stop();
-    wait_us(145);
+    wait_us(PMW3360_tSWW);
+    spi_release(busy);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Asynchronous register operations
+
+typedef enum {
+    pmw3360_OP_WRITE,
+    pmw3360_OP_READ,
+    pmw3360_OP_DELAY,
+    pmw3360_OP_SROM,
+} pmw3360_op_kind_t;
+
+typedef struct {
+    uint8_t           kind;
+    uint8_t           addr;
+    uint8_t           data;
+    pmw3360_read_cb_t cb;
+} pmw3360_op_t;
+
+typedef enum {
+    pmw3360_STEP_IDLE = 0,
+    pmw3360_STEP_WRITE_HOLD, // NCS is low, waiting tSCLK-NCS to finish write.
+    pmw3360_STEP_READ_WAIT,  // NCS is low, waiting tSRAD to read data.
+    pmw3360_STEP_READ_DONE,  // NCS is high, waiting tSRR to call back.
+    pmw3360_STEP_SROM_BURST, // NCS is low, waiting to send SROM.
+} pmw3360_step_t;
+
+static pmw3360_op_t queue[PMW3360_QUEUE_SIZE];
+static uint8_t      queue_head  = 0;
+static uint8_t      queue_count = 0;
+
+static pmw3360_op_t current;
+static uint8_t      step = pmw3360_STEP_IDLE;
+
+// SROM which is being uploaded by pmw3360_OP_SROM.
+static pmw3360_srom_t srom_pending = {0};
+
+// Any access to the sensor can't be started until deadline_wait passes
+// since deadline_start.
+static uint32_t deadline_start = 0;
+static uint32_t deadline_wait  = 0;
+
+static void deadline_set(uint32_t now, uint32_t wait) {
+    deadline_start = now;
+    deadline_wait  = wait + PMW3360_TIMER_RESOLUTION;
+}
+
+static bool deadline_passed(uint32_t now) {
+    return TIMER_DIFF_32(now, deadline_start) >= deadline_wait;
+}
+
+static bool queue_push(uint8_t kind, uint8_t addr, uint8_t data, pmw3360_read_cb_t cb) {
+    if (queue_count >= PMW3360_QUEUE_SIZE) {
+        return false;
+    }
+    uint8_t i = (queue_head + queue_count) % PMW3360_QUEUE_SIZE;
+    queue[i]  = (pmw3360_op_t){.kind = kind, .addr = addr, .data = data, .cb = cb};
+    queue_count++;
+    return true;
+}
+
+bool pmw3360_async_write(uint8_t addr, uint8_t data) {
+    return queue_push(pmw3360_OP_WRITE, addr, data, NULL);
+}
+
+bool pmw3360_async_read(uint8_t addr, pmw3360_read_cb_t cb) {
+    return queue_push(pmw3360_OP_READ, addr, 0, cb);
+}
+
+bool pmw3360_async_delay(uint8_t ms) {
+    return queue_push(pmw3360_OP_DELAY, 0, ms, NULL);
+}
+
+bool pmw3360_async_room(uint8_t n) {
+    return PMW3360_QUEUE_SIZE - queue_count >= n;
+}
+
+bool pmw3360_async_busy(void) {
+    return queue_count > 0 || step != pmw3360_STEP_IDLE || !deadline_passed(pmw3360_timer_us());
+}
+
+static void op_start(uint32_t now) {
+    current = queue[queue_head];
+    queue_head = (queue_head + 1) % PMW3360_QUEUE_SIZE;
+    queue_count--;
+    if (current.kind != pmw3360_OP_DELAY && current.addr != pmw3360_Motion_Burst) {
+        motion_bursting = false;
+    }
+    switch (current.kind) {
+        case pmw3360_OP_WRITE:
+            pmw3360_spi_start();
+            spi_write(current.addr | 0x80);
+            spi_write(current.data);
+            deadline_set(now, PMW3360_tSCLK_NCS_W);
+            step = pmw3360_STEP_WRITE_HOLD;
+            break;
+        case pmw3360_OP_READ:
+            pmw3360_spi_start();
+            spi_write(current.addr & 0x7f);
+            deadline_set(now, PMW3360_tSRAD);
+            step = pmw3360_STEP_READ_WAIT;
+            break;
+        case pmw3360_OP_DELAY:
+            deadline_set(now, (uint32_t)current.data * 1000);
+            break;
+        case pmw3360_OP_SROM:
+            // SROM upload (download for PMW3360) with burst mode
+            pmw3360_spi_start();
+            spi_write(pmw3360_SROM_Load_Burst | 0x80);
+            deadline_set(now, 15);
+            step = pmw3360_STEP_SROM_BURST;
+            break;
+    }
+}
+
+void pmw3360_task(void) {
+    uint32_t now = pmw3360_timer_us();
+    if (!deadline_passed(now)) {
+        return;
+    }
+    // Keep the sampler away while changing the state.
+    spi_busy = true;
+    switch (step) {
+        case pmw3360_STEP_IDLE:
+            if (queue_count == 0 && burst_wanted && !motion_bursting) {
+                queue_push(pmw3360_OP_WRITE, pmw3360_Motion_Burst, 0, NULL);
+                burst_wanted = false;
+            }
+            if (queue_count > 0) {
+                op_start(now);
+            }
+            break;
+        case pmw3360_STEP_WRITE_HOLD:
+            spi_stop();
+            if (current.addr == pmw3360_Motion_Burst) {
+                motion_bursting = true;
+            }
+            deadline_set(now, PMW3360_tSWW);
+            step = pmw3360_STEP_IDLE;
+            break;
+        case pmw3360_STEP_READ_WAIT:
+            current.data = spi_read();
+            spi_stop();
+            deadline_set(now, PMW3360_tSRR);
+            step = pmw3360_STEP_READ_DONE;
+            break;
+        case pmw3360_STEP_SROM_BURST:
+            // Send whole SROM in this pass, so NCS is never held low across
+            // passes of the main loop.  The datasheet gives only the minimum
+            // gap between bytes (15us).  Interrupts may still stretch a gap
+            // by the length of their handler, as they always could in
+            // pmw3360_srom_upload().
+            for (size_t i = 0; i < srom_pending.len; i++) {
+                spi_write(pgm_read_byte(srom_pending.data + i));
+                wait_us(15);
+            }
+            spi_stop();
+            deadline_set(pmw3360_timer_us(), 200);
+            step = pmw3360_STEP_IDLE;
+            break;
+        case pmw3360_STEP_READ_DONE:
+            // Call back after tSRR, so it can access the sensor immediately.
+            step     = pmw3360_STEP_IDLE;
+            spi_busy = false;
+            if (current.cb) {
+                current.cb(current.addr, current.data);
+            }
+            break;
+    }
+    spi_busy = false;
 }
 
 uint8_t pmw3360_cpi_get(void) {
+    // pmw3360_reg_read() keeps the sampler away by itself.
     return pmw3360_reg_read(pmw3360_Config1);
 }
 
-void pmw3360_cpi_set(uint8_t cpi) {
+bool pmw3360_cpi_set(uint8_t cpi) {
     if (cpi > pmw3360_MAXCPI) {
         cpi = pmw3360_MAXCPI;
     }
-    pmw3360_reg_write(pmw3360_Config1, cpi);
+    return pmw3360_async_write(pmw3360_Config1, cpi);
+}
+
+bool pmw3360_rest_set(bool enable, const pmw3360_rest_t *rest) {
+    if (!enable) {
+        return pmw3360_async_write(pmw3360_Config2, 0x00);
+    }
+    if (!pmw3360_async_room(10)) {
+        return false;
+    }
+    bool ok = pmw3360_async_write(pmw3360_Run_Downshift, rest->run_downshift);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest1_Rate_Lower, rest->rest1_rate & 0xff);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest1_Rate_Upper, rest->rest1_rate >> 8);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest1_Downshift, rest->rest1_downshift);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest2_Rate_Lower, rest->rest2_rate & 0xff);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest2_Rate_Upper, rest->rest2_rate >> 8);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest2_Downshift, rest->rest2_downshift);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest3_Rate_Lower, rest->rest3_rate & 0xff);
+    ok      = ok && pmw3360_async_write(pmw3360_Rest3_Rate_Upper, rest->rest3_rate >> 8);
+    ok      = ok && pmw3360_async_write(pmw3360_Config2, pmw3360_CONFIG2_REST_EN);
+    return ok;
+}
+
+bool pmw3360_lift_cal_start(void) {
+    return pmw3360_async_write(pmw3360_LiftCutoff_Tune3, 0x80);
+}
+
+bool pmw3360_lift_cal_stop(pmw3360_read_cb_t cb) {
+    if (!pmw3360_async_room(2)) {
+        return false;
+    }
+    bool ok = pmw3360_async_write(pmw3360_LiftCutoff_Tune3, 0x00);
+    ok      = ok && pmw3360_async_read(pmw3360_LiftCutoff_Tune1, cb);
+    return ok;
+}
+
+bool pmw3360_lift_cutoff_set(uint8_t tune) {
+    return pmw3360_async_write(pmw3360_LiftCutoff_Tune2, tune);
+}
+
+bool pmw3360_angle_set(int8_t deg, bool snap) {
+    if (deg > pmw3360_ANGLE_TUNE_MAX) {
+        deg = pmw3360_ANGLE_TUNE_MAX;
+    } else if (deg < -pmw3360_ANGLE_TUNE_MAX) {
+        deg = -pmw3360_ANGLE_TUNE_MAX;
+    }
+    if (!pmw3360_async_room(2)) {
+        return false;
+    }
+    bool ok = pmw3360_async_write(pmw3360_Angle_Tune, (uint8_t)deg);
+    ok      = ok && pmw3360_async_write(pmw3360_Angle_Snap, snap ? pmw3360_ANGLE_SNAP_EN : 0);
+    return ok;
+}
+
+void pmw3360_async_abort(void) {
+    spi_busy = true;
+    if (step == pmw3360_STEP_WRITE_HOLD || step == pmw3360_STEP_READ_WAIT || step == pmw3360_STEP_SROM_BURST) {
+        // NCS is low in the middle of an operation.
+        spi_stop();
+    }
+    queue_count = 0;
+    step        = pmw3360_STEP_IDLE;
+    // Drop a pending delay, but keep the gap required after NCS rise.
+    deadline_set(pmw3360_timer_us(), PMW3360_tSWW);
+    spi_busy = false;
+}
+
+bool pmw3360_shutdown(void) {
+#if defined(PMW3360_SAMPLE_RATE)
+    pmw3360_sampler_stop();
+#endif
+    // Settings and SROM are lost by shutdown, so nothing queued matters.
+    pmw3360_async_abort();
+    return pmw3360_async_write(pmw3360_Shutdown, 0xB6);
 }
 
 static uint32_t pmw3360_timer      = 0;
@@ -93,45 +403,188 @@ bool pmw3360_motion_read(pmw3360_motion_t *d) {
 #ifdef DEBUG_PMW3360_SCAN_RATE
     pmw3360_scan_perf_task();
 #endif
-    uint8_t mot = pmw3360_reg_read(pmw3360_Motion);
-    if ((mot & 0x88) != 0x80) {
+    // Hold SPI across all reads: a motion burst by the sampler between them
+    // would clear the delta registers.
+    bool    busy = spi_claim();
+    uint8_t mot  = pmw3360_reg_read(pmw3360_Motion);
+    if ((mot & (pmw3360_MOTION_MOT | pmw3360_MOTION_LIFT)) != pmw3360_MOTION_MOT) {
+        spi_release(busy);
         return false;
     }
+    d->motion = mot;
     d->x = pmw3360_reg_read(pmw3360_Delta_X_L);
     d->x |= pmw3360_reg_read(pmw3360_Delta_X_H) << 8;
     d->y = pmw3360_reg_read(pmw3360_Delta_Y_L);
     d->y |= pmw3360_reg_read(pmw3360_Delta_Y_H) << 8;
+    spi_release(busy);
     return true;
 }
 
-bool pmw3360_motion_burst(pmw3360_motion_t *d) {
-#ifdef DEBUG_PMW3360_SCAN_RATE
-    pmw3360_scan_perf_task();
-#endif
+// motion_burst reads a motion burst frame.  When motion burst mode is not
+// started yet, it starts the mode with a blocking write if can_block is true,
+// or asks pmw3360_task() to start it and skips this frame.
+static bool motion_burst(pmw3360_motion_t *d, bool can_block) {
+    // Asynchronous operations own the sensor until they are completed.
+    if (pmw3360_async_busy()) {
+        return false;
+    }
     // Start motion burst if motion burst mode is not started.
     if (!motion_bursting) {
+        if (!can_block) {
+            burst_wanted = true;
+            return false;
+        }
         pmw3360_reg_write(pmw3360_Motion_Burst, 0);
         motion_bursting = true;
     }
 
+    uint8_t buf[12];
     pmw3360_spi_start();
     spi_write(pmw3360_Motion_Burst);
     wait_us(35);
-    spi_read(); // skip MOT
-    spi_read(); // skip Observation
-    d->x = spi_read();
-    d->x |= spi_read() << 8;
-    d->y = spi_read();
-    d->y |= spi_read() << 8;
+    spi_receive(buf, sizeof(buf));
     spi_stop();
     // Required NCS in 500ns after motion burst.
     wait_us(1);
+
+    d->motion = buf[0];
+    if ((d->motion & pmw3360_MOTION_MOT) == 0) {
+        return false;
+    }
+    d->observation  = buf[1];
+    d->x            = buf[2] | (buf[3] << 8);
+    d->y            = buf[4] | (buf[5] << 8);
+    d->squal        = buf[6];
+    d->raw_data_sum = buf[7];
+    d->raw_data_max = buf[8];
+    d->raw_data_min = buf[9];
+    d->shutter      = (buf[10] << 8) | buf[11];
     return true;
 }
 
+bool pmw3360_motion_burst(pmw3360_motion_t *d) {
+#ifdef DEBUG_PMW3360_SCAN_RATE
+    pmw3360_scan_perf_task();
+#endif
+    bool busy = spi_claim();
+    bool ok   = motion_burst(d, true);
+    spi_release(busy);
+    return ok;
+}
+
+#if defined(PMW3360_SAMPLE_RATE)
+
+#    if !defined(__AVR__)
+#        error "PMW3360_SAMPLE_RATE is supported only on AVR"
+#    endif
+#    if defined(AUDIO_ENABLE)
+#        error "PMW3360_SAMPLE_RATE uses Timer3, it conflicts with AUDIO_ENABLE"
+#    endif
+
+// Running totals of motion and the last frame, written only by the ISR.
+// sample_seq is incremented after each update, so the reader can detect
+// an update in the middle of reading without disabling interrupts.
+// It is 16 bits so that frames between drains can't wrap it back to the
+// drained value: 256 frames are only 256ms at 1kHz.  A torn read of it
+// never matches the read after the copy, so the reader just retries.
+static volatile uint16_t         sample_x   = 0;
+static volatile uint16_t         sample_y   = 0;
+static volatile uint16_t         sample_seq = 0;
+static volatile pmw3360_motion_t sample_last;
+
+// Running count of frames dropped by low SQUAL, written only by the ISR.
+static volatile uint8_t sample_gated = 0;
+static uint8_t          squal_min    = 0;
+
+// Totals at the last drain, used only by the reader.
+static uint16_t drained_x     = 0;
+static uint16_t drained_y     = 0;
+static uint16_t drained_seq   = 0;
+static uint8_t  drained_gated = 0;
+
+// Let other interrupts (soft serial, timer0) preempt sampling.
+ISR(TIMER3_COMPA_vect, ISR_NOBLOCK) {
+    if (spi_busy) {
+        return;
+    }
+    pmw3360_motion_t d = {0};
+    if (!motion_burst(&d, false) || (d.motion & pmw3360_MOTION_LIFT) != 0) {
+        // Drop lifted frames, but keep the status for the reader.
+        sample_last.motion = d.motion;
+        return;
+    }
+    if (d.squal < squal_min) {
+        // Drop frames on a poor surface, but keep its quality for the reader.
+        sample_last.motion  = d.motion;
+        sample_last.squal   = d.squal;
+        sample_last.shutter = d.shutter;
+        sample_gated++;
+        return;
+    }
+    sample_x += d.x;
+    sample_y += d.y;
+    sample_last = d;
+    sample_seq++;
+}
+
+void pmw3360_sampler_start(void) {
+    // Timer3: CTC mode, prescaler 8.
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS31);
+    OCR3A  = F_CPU / 8 / PMW3360_SAMPLE_RATE - 1;
+    TCNT3  = 0;
+    TIMSK3 = _BV(OCIE3A);
+}
+
+void pmw3360_sampler_stop(void) {
+    TIMSK3 = 0;
+    TCCR3B = 0;
+}
+
+void pmw3360_sampler_squal_min_set(uint8_t min) {
+    squal_min = min;
+}
+
+uint8_t pmw3360_sampler_gated(void) {
+    uint8_t n     = sample_gated;
+    uint8_t r     = n - drained_gated;
+    drained_gated = n;
+    return r;
+}
+
+bool pmw3360_sampler_drain(pmw3360_motion_t *d) {
+    uint16_t seq, x, y;
+    do {
+        seq = sample_seq;
+        x   = sample_x;
+        y   = sample_y;
+        // Copy field by field through the volatile object, so the compiler
+        // can't hoist the loads out of the retry loop.
+        d->motion       = sample_last.motion;
+        d->observation  = sample_last.observation;
+        d->squal        = sample_last.squal;
+        d->raw_data_sum = sample_last.raw_data_sum;
+        d->raw_data_max = sample_last.raw_data_max;
+        d->raw_data_min = sample_last.raw_data_min;
+        d->shutter      = sample_last.shutter;
+    } while (seq != sample_seq);
+    if (seq == drained_seq) {
+        return false;
+    }
+    d->x        = (int16_t)(x - drained_x);
+    d->y        = (int16_t)(y - drained_y);
+    drained_x   = x;
+    drained_y   = y;
+    drained_seq = seq;
+    return true;
+}
+
+#endif
+
 bool pmw3360_init(void) {
     spi_init();
     setPinOutput(PMW3360_NCS_PIN);
+    bool busy = spi_claim();
     // reboot
     pmw3360_spi_start();
     pmw3360_reg_write(pmw3360_Power_Up_Reset, 0x5a);
@@ -148,12 +601,69 @@ bool pmw3360_init(void) {
     uint8_t pid = pmw3360_reg_read(pmw3360_Product_ID);
     uint8_t rev = pmw3360_reg_read(pmw3360_Revision_ID);
     spi_stop();
+    spi_release(busy);
     return pid == 0x42 && rev == 0x01;
 }
 
+static pmw3360_init_cb_t init_done = NULL;
+static uint8_t           init_pid  = 0;
+
+static void init_check_id(uint8_t addr, uint8_t data) {
+    if (addr == pmw3360_Product_ID) {
+        init_pid = data;
+        return;
+    }
+    if (init_done) {
+        init_done(init_pid == 0x42 && data == 0x01);
+    }
+}
+
+bool pmw3360_init_async(pmw3360_init_cb_t done) {
+    spi_init();
+    setPinOutput(PMW3360_NCS_PIN);
+    init_done = done;
+    if (!pmw3360_async_room(10)) {
+        return false;
+    }
+    // reboot
+    bool ok = pmw3360_async_write(pmw3360_Power_Up_Reset, 0x5a);
+    ok      = ok && pmw3360_async_delay(50);
+    // read five registers of motion and discard those values
+    ok = ok && pmw3360_async_read(pmw3360_Motion, NULL);
+    ok = ok && pmw3360_async_read(pmw3360_Delta_X_L, NULL);
+    ok = ok && pmw3360_async_read(pmw3360_Delta_X_H, NULL);
+    ok = ok && pmw3360_async_read(pmw3360_Delta_Y_L, NULL);
+    ok = ok && pmw3360_async_read(pmw3360_Delta_Y_H, NULL);
+    // configuration
+    ok = ok && pmw3360_async_write(pmw3360_Config2, 0x00);
+    // check product ID and revision ID
+    ok = ok && pmw3360_async_read(pmw3360_Product_ID, init_check_id);
+    ok = ok && pmw3360_async_read(pmw3360_Revision_ID, init_check_id);
+    return ok;
+}
+
+bool pmw3360_probe(void) {
+    spi_init();
+    setPinOutput(PMW3360_NCS_PIN);
+    bool busy = spi_claim();
+    bool ok   = false;
+    // The sensor may be still powering up, retry about 50ms at most.
+    for (uint8_t i = 0; i < 10 && !ok; i++) {
+        uint8_t pid = pmw3360_reg_read(pmw3360_Product_ID);
+        uint8_t inv = pmw3360_reg_read(pmw3360_Inverse_Product_ID);
+        ok          = pid == 0x42 && inv == 0xBD;
+        if (!ok) {
+            wait_ms(5);
+        }
+    }
+    spi_release(busy);
+    return ok;
+}
+
 uint8_t pmw3360_srom_id = 0;
 
 void pmw3360_srom_upload(pmw3360_srom_t srom) {
+    bool busy = spi_claim();
     pmw3360_reg_write(pmw3360_Config2, 0x00);
     pmw3360_reg_write(pmw3360_SROM_Enable, 0x1d);
     wait_us(10);
@@ -173,4 +683,95 @@ void pmw3360_srom_upload(pmw3360_srom_t srom) {
     pmw3360_srom_id = pmw3360_reg_read(pmw3360_SROM_ID);
     pmw3360_reg_write(pmw3360_Config2, 0x00);
     wait_ms(10);
+    spi_release(busy);
+}
+
+static pmw3360_init_cb_t srom_done      = NULL;
+static uint8_t           srom_uploads   = 0; // remained count of upload
+static uint8_t           srom_crc_lower = 0;
+
+static bool srom_queue_upload(void);
+
+static void srom_finish(bool ok) {
+    if (!ok && srom_uploads > 0) {
+        srom_uploads--;
+        if (srom_queue_upload()) {
+            return;
+        }
+    }
+    if (srom_done) {
+        srom_done(ok);
+    }
+}
+
+static void srom_on_crc(uint8_t addr, uint8_t data) {
+    if (addr == pmw3360_Data_Out_Lower) {
+        srom_crc_lower = data;
+        return;
+    }
+    uint16_t crc = (data << 8) | srom_crc_lower;
+    if (crc != pmw3360_SROM_CRC_OK) {
+#if defined(CONSOLE_ENABLE)
+        dprintf("pmw3360: SROM CRC error: %04X\n", crc);
+#endif
+        srom_finish(false);
+        return;
+    }
+    srom_finish(true);
+}
+
+static void srom_on_id(uint8_t addr, uint8_t data) {
+    pmw3360_srom_id = data;
+    // The second byte of SROM is its ID.
+    if (data != pgm_read_byte(srom_pending.data + 1)) {
+        srom_finish(false);
+        return;
+    }
+    // Run SROM CRC self-test.
+    if (!pmw3360_async_room(4)) {
+        srom_finish(false);
+        return;
+    }
+    bool ok = pmw3360_async_write(pmw3360_SROM_Enable, 0x15);
+    ok      = ok && pmw3360_async_delay(10);
+    ok      = ok && pmw3360_async_read(pmw3360_Data_Out_Lower, srom_on_crc);
+    ok      = ok && pmw3360_async_read(pmw3360_Data_Out_Upper, srom_on_crc);
+    if (!ok) {
+        srom_finish(false);
+    }
+}
+
+static bool srom_queue_check(void) {
+    return pmw3360_async_read(pmw3360_SROM_ID, srom_on_id);
+}
+
+static bool srom_queue_upload(void) {
+    if (!pmw3360_async_room(7)) {
+        return false;
+    }
+    bool ok = pmw3360_async_write(pmw3360_Config2, 0x00);
+    ok      = ok && pmw3360_async_write(pmw3360_SROM_Enable, 0x1d);
+    ok      = ok && pmw3360_async_delay(10);
+    ok      = ok && pmw3360_async_write(pmw3360_SROM_Enable, 0x18);
+    ok      = ok && queue_push(pmw3360_OP_SROM, 0, 0, NULL);
+    ok      = ok && pmw3360_async_write(pmw3360_Config2, 0x00);
+    ok      = ok && srom_queue_check();
+    return ok;
+}
+
+bool pmw3360_srom_check_async(pmw3360_srom_t srom, pmw3360_init_cb_t done) {
+    spi_init();
+    setPinOutput(PMW3360_NCS_PIN);
+    srom_pending = srom;
+    srom_done    = done;
+    srom_uploads = 0;
+    return srom_queue_check();
+}
+
+bool pmw3360_srom_upload_async(pmw3360_srom_t srom, pmw3360_init_cb_t done) {
+    srom_pending = srom;
+    srom_done    = done;
+    // Upload again once when the check after upload is failed.
+    srom_uploads = 1;
+    return srom_queue_upload();
 }
@@ -27,6 +27,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #    define PMW3360_NCS_PIN B6
 #endif
 
+/// PMW3360_QUEUE_SIZE is the max number of asynchronous register operations
+/// which can be queued at once.
+#ifndef PMW3360_QUEUE_SIZE
+#    define PMW3360_QUEUE_SIZE 16
+#endif
+
+/// PMW3360_SAMPLE_RATE enables sampling motion by a timer interrupt at a fixed
+/// rate in Hz, for example 1000.  Sampled motion is accumulated and should be
+/// taken by pmw3360_sampler_drain() instead of pmw3360_motion_burst().
+/// This works only on AVR, and uses Timer3.
+//#define PMW3360_SAMPLE_RATE 1000
+
 /// DEBUG_PMW3360_SCAN_RATE enables scan performance counter.
 /// It records scan count in a last second and enables pmw3360_scan_rate_get().
 /// Additionally, it will be logged automatically when defined CONSOLE_ENABLE
@@ -41,11 +53,40 @@ typedef struct {
     size_t         len;
 } pmw3360_srom_t;
 
+/// pmw3360_motion_t is a frame of Motion_Burst.
+/// Fields after `y` are filled only by pmw3360_motion_burst().
 typedef struct {
-    int16_t x;
-    int16_t y;
+    int16_t  x;
+    int16_t  y;
+    uint8_t  motion;       // Motion register: MOT, Lift_Stat, OP_Mode
+    uint8_t  observation;  // Observation register
+    uint8_t  squal;        // Surface quality: number of valid features / 4
+    uint8_t  raw_data_sum; // Sum of raw data / 256
+    uint8_t  raw_data_max; // Maximum_Raw_data
+    uint8_t  raw_data_min; // Minimum_Raw_data
+    uint16_t shutter;      // Shutter_Upper:Shutter_Lower
 } pmw3360_motion_t;
 
+/// pmw3360_read_cb_t is called with a value when an asynchronous register read
+/// is completed.
+typedef void (*pmw3360_read_cb_t)(uint8_t addr, uint8_t data);
+
+/// pmw3360_init_cb_t is called when an asynchronous initialization or SROM
+/// upload is completed.  `ok` is true when it is succeeded.
+typedef void (*pmw3360_init_cb_t)(bool ok);
+
+/// pmw3360_rest_t is timings of rest modes.  The sensor downshifts from Run
+/// mode to Rest1, Rest2 and Rest3 mode in order while no motion, then frame
+/// rate is reduced to save power.
+typedef struct {
+    uint8_t  run_downshift;   // Run to Rest1: value * 10ms
+    uint16_t rest1_rate;      // Frame period of Rest1: (value + 1) ms
+    uint8_t  rest1_downshift; // Rest1 to Rest2: value * 320 * Rest1 period
+    uint16_t rest2_rate;      // Frame period of Rest2: (value + 1) ms
+    uint8_t  rest2_downshift; // Rest2 to Rest3: value * 32 * Rest2 period
+    uint16_t rest3_rate;      // Frame period of Rest3: (value + 1) ms
+} pmw3360_rest_t;
+
 typedef enum {
     pmw3360_Product_ID                 = 0x00,
     pmw3360_Revision_ID                = 0x01,
@@ -102,6 +143,31 @@ enum {
     pmw3360_MAXCPI = 0x77, // = 119: 12000 CPI
 };
 
+// Bits of Config2 register.
+enum {
+    pmw3360_CONFIG2_REST_EN = 0x20, // Enable rest modes
+};
+
+// Bits of Angle_Snap register.
+enum {
+    pmw3360_ANGLE_SNAP_EN = 0x80, // Enable angle snapping
+};
+
+// Range of Angle_Tune register in degrees.
+enum {
+    pmw3360_ANGLE_TUNE_MAX = 30,
+};
+
+enum {
+    pmw3360_SROM_CRC_OK = 0xBEEF, // Data_Out of passed SROM CRC self-test.
+};
+
+// Bits of Motion register.
+enum {
+    pmw3360_MOTION_MOT  = 0x80, // Motion since last report
+    pmw3360_MOTION_LIFT = 0x08, // Lift_Stat: the chip is lifted
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // Exported values (touch carefully)
 
@@ -118,20 +184,76 @@ extern const pmw3360_srom_t pmw3360_srom_0x81;
 
 /// pmw3360_init initializes PMW3360DM-T2QU module.
 /// It will return true when succeeded, otherwise false.
+/// This blocks about 55ms, prefer pmw3360_init_async() if possible.
 bool pmw3360_init(void);
 
+/// pmw3360_init_async queues initialization of PMW3360DM-T2QU module.
+/// `done` will be called from pmw3360_task() when it is completed.
+/// It will return false when the queue doesn't have enough room.
+bool pmw3360_init_async(pmw3360_init_cb_t done);
+
+/// pmw3360_probe checks existence of the sensor by reading product IDs,
+/// without rebooting it.  This is much faster than pmw3360_init() when the
+/// sensor is already powered up.
+bool pmw3360_probe(void);
+
+/// pmw3360_srom_upload uploads SROM to the sensor.
+/// This blocks about 70ms, prefer pmw3360_srom_upload_async().
 void pmw3360_srom_upload(pmw3360_srom_t srom);
 
+/// pmw3360_srom_upload_async queues upload of SROM.  The steps around the
+/// upload run from pmw3360_task() without blocking, but SROM itself is sent
+/// in one pass of it, which blocks about 70ms: NCS must stay low through the
+/// burst, so it isn't split across passes.  Motion burst is suspended until
+/// completed.
+/// After upload, SROM ID and SROM CRC self-test are checked.  When the check
+/// is failed, it uploads again once.
+/// `done` will be called with true when the check is passed.
+bool pmw3360_srom_upload_async(pmw3360_srom_t srom, pmw3360_init_cb_t done);
+
+/// pmw3360_srom_check_async queues checks of SROM ID and SROM CRC self-test,
+/// without uploading.  It is useful to skip upload after warm reset of MCU,
+/// the sensor keeps SROM while it is powered.
+/// `done` will be called with true when the expected SROM is running.
+bool pmw3360_srom_check_async(pmw3360_srom_t srom, pmw3360_init_cb_t done);
+
 /// pmw3360_motion_read gets a motion data by Motion register.
 /// This requires to write a dummy data to pmw3360_Motion register
 /// just before.
 bool pmw3360_motion_read(pmw3360_motion_t *d);
 
 /// pmw3360_motion_burst gets a motion data by Motion_Burst command.
-/// This requires to write a dummy data to pmw3360_Motion_Burst register
-/// just before.
+/// It reads whole 12 bytes of a frame with one block transfer.
+/// It will return false when no motion (MOT bit is cleared) or the sensor is
+/// busy with asynchronous operations.
 bool pmw3360_motion_burst(pmw3360_motion_t *d);
 
+#if defined(PMW3360_SAMPLE_RATE)
+/// pmw3360_sampler_start starts sampling by timer interrupt.
+/// Start it after the sensor is initialized.
+/// Keep calling pmw3360_task(): the sampler skips frames until it starts
+/// motion burst mode, because the interrupt can't wait for that write.
+void pmw3360_sampler_start(void);
+
+/// pmw3360_sampler_stop stops sampling by timer interrupt.
+void pmw3360_sampler_stop(void);
+
+/// pmw3360_sampler_squal_min_set sets the minimum SQUAL of sampled frames.
+/// Frames below it are dropped before accumulation.  0 disables it.
+void pmw3360_sampler_squal_min_set(uint8_t min);
+
+/// pmw3360_sampler_gated returns the number of frames dropped by SQUAL since
+/// last call.
+uint8_t pmw3360_sampler_gated(void);
+
+/// pmw3360_sampler_drain gets motion accumulated by the sampler since last
+/// call.  Fields other than `x` and `y` are of the latest frame.  `motion`,
+/// `squal` and `shutter` are updated even by dropped frames, so Lift_Stat and
+/// surface quality can be checked when it returns false.
+/// It will return false when no motion was sampled.
+bool pmw3360_sampler_drain(pmw3360_motion_t *d);
+#endif
+
 /// pmw3360_scan_rate_get gets count of scan in a last second.
 /// This works only when DEBUG_PMW3360_SCAN_RATE is defined.
 uint32_t pmw3360_scan_rate_get(void);
@@ -139,16 +261,99 @@ uint32_t pmw3360_scan_rate_get(void);
 // TODO: document
 uint8_t pmw3360_cpi_get(void);
 
-// TODO: document
-void pmw3360_cpi_set(uint8_t cpi);
+/// pmw3360_cpi_set queues an update of CPI, it doesn't block.
+/// It will return false when the queue is full.
+bool pmw3360_cpi_set(uint8_t cpi);
+
+/// pmw3360_rest_set queues configuration of rest modes.
+/// It queues all writes or nothing, and returns false when the queue hasn't
+/// enough room.
+/// When `enable` is false, the sensor always runs at full frame rate.
+/// `rest` is ignored when `enable` is false.
+/// Initialization and SROM upload disable rest modes, so call this after
+/// them.
+bool pmw3360_rest_set(bool enable, const pmw3360_rest_t *rest);
+
+/// pmw3360_shutdown queues shutdown of the sensor.  All settings and SROM
+/// will be lost, so initialize it again to wake up.
+/// It aborts all queued operations first, so the shutdown completes in
+/// a few hundred microseconds of pmw3360_task() calls.
+bool pmw3360_shutdown(void);
+
+/// pmw3360_lift_cal_start starts lift cutoff calibration.  Move the ball on
+/// its surface in various directions, then stop it.
+bool pmw3360_lift_cal_start(void);
+
+/// pmw3360_lift_cal_stop stops lift cutoff calibration.  `cb` will be called
+/// with the calibrated value of LiftCutoff_Tune1.
+/// It queues nothing and returns false when the queue hasn't enough room.
+bool pmw3360_lift_cal_stop(pmw3360_read_cb_t cb);
+
+/// pmw3360_lift_cutoff_set applies a calibrated value of lift cutoff.
+/// It must be applied again after initialization or SROM upload.
+bool pmw3360_lift_cutoff_set(uint8_t tune);
+
+/// pmw3360_angle_set rotates reported motion by `deg` degrees with Angle_Tune,
+/// and enables angle snapping with Angle_Snap when `snap` is true.
+/// `deg` is clamped to +/-pmw3360_ANGLE_TUNE_MAX.
+/// It must be applied again after initialization or SROM upload.
+/// It queues nothing and returns false when the queue hasn't enough room.
+bool pmw3360_angle_set(int8_t deg, bool snap);
+
+/// pmw3360_timer_us returns a timestamp in microseconds.
+/// It wraps around in about 71 minutes, so use only its difference.
+/// It is safe to call with interrupts masked, and never goes backwards.
+uint32_t pmw3360_timer_us(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Asynchronous register operations
+//
+// These queue register operations, then pmw3360_task() advances them.
+// Timings between accesses (tSRAD, tSWW, tSWR, ...) are enforced as deadlines
+// instead of busy-waits, so they never stall the main loop.
+// Motion burst is suspended until all queued operations are completed.
+// Queue operations only from the main loop, never from interrupt handlers.
+// A sequence of operations should check pmw3360_async_room() first, so it
+// is never applied partially.
+
+/// pmw3360_async_write queues a write of a value to a register.
+/// It will return false when the queue is full.
+bool pmw3360_async_write(uint8_t addr, uint8_t data);
+
+/// pmw3360_async_read queues a read from a register.  `cb` will be called
+/// with the value when completed.  It will return false when the queue is full.
+bool pmw3360_async_read(uint8_t addr, pmw3360_read_cb_t cb);
+
+/// pmw3360_async_delay queues a delay in milliseconds between operations.
+bool pmw3360_async_delay(uint8_t ms);
+
+/// pmw3360_async_room returns true when `n` more operations can be queued.
+bool pmw3360_async_room(uint8_t n);
+
+/// pmw3360_async_abort discards queued operations and the one in progress
+/// without calling their callbacks.  An aborted SROM upload leaves the sensor
+/// in an unknown state, so reset it afterwards.
+void pmw3360_async_abort(void);
+
+/// pmw3360_async_busy returns true while any asynchronous operations are
+/// pending or in progress.
+bool pmw3360_async_busy(void);
+
+/// pmw3360_task advances asynchronous operations.
+/// Call this from the main loop as frequently as possible.
+void pmw3360_task(void);
 
 //////////////////////////////////////////////////////////////////////////////
 // Register operations
 
 /// pmw3360_reg_write writes a value to a register.
+/// This blocks about 180us, prefer pmw3360_async_write().
+/// The sampler doesn't access the sensor until this returns.
 void pmw3360_reg_write(uint8_t addr, uint8_t data);
 
 /// pmw3360_reg_read reads a value from a register.
+/// This blocks about 180us, prefer pmw3360_async_read().
+/// The sampler doesn't access the sensor until this returns.
 uint8_t pmw3360_reg_read(uint8_t addr);
 
 //////////////////////////////////////////////////////////////////////////////
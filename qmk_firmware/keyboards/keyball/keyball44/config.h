@@ -40,7 +40,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // it has been reported to work well in such cases.
 //#define SPLIT_WATCHDOG_ENABLE
 
-#define SPLIT_TRANSACTION_IDS_KB KEYBALL_GET_INFO, KEYBALL_GET_MOTION, KEYBALL_SET_CPI
+#define SPLIT_TRANSACTION_IDS_KB KEYBALL_BATCH
+
+// USB endpoint polling interval in ms.  Mouse reports can't reach the host
+// faster than this, so keep it at 1ms for the 1000Hz report rate (RPT_NEXT).
+#define USB_POLLING_INTERVAL_MS 1
 
 // RGB LED settings
 #define WS2812_DI_PIN       D3
@@ -74,6 +78,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #    define LAYER_STATE_8BIT
 #endif
 
+// EEPROM datablock for Keyball's settings which don't fit in 32 bits
+// (keyball_datablock_t)
+#define EECONFIG_KB_DATA_SIZE 16
+
 // To squeeze firmware size
 #undef LOCKING_SUPPORT_ENABLE
 #undef LOCKING_RESYNC_ENABLE
@@ -58,7 +58,8 @@ bool is_keyboard_left(void) {
 
 void keyball_on_adjust_layout(keyball_adjust_t v) {
     if (v == KEYBALL_ADJUST_PRIMARY) {
-        // adjust matrix mask
+        // adjust matrix mask (reset first, this may run again after re-negotiation)
+        matrix_mask[2] = matrix_mask[3] = matrix_mask[6] = matrix_mask[7] = 0b0011111;
         bool is_left                                                      = is_keyboard_left();
         matrix_mask[(is_left ? 2 : 6) + (keyball.this_have_ball ? 0 : 1)] = 0b0111111;
         matrix_mask[(is_left ? 6 : 2) + (keyball.that_have_ball ? 0 : 1)] = 0b0111111;
@@ -35,5 +35,5 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // PMW3360 performance counter. Require CONSOLE_ENABLE too.
 //#define DEBUG_PMW3360_SCAN_RATE
 
-// Disable mouse report rate throttling.
-//#define KEYBALL_REPORTMOUSE_INTERVAL 0
+// Report mouse motion at 1000Hz from startup.
+//#define KEYBALL_REPORT_RATE_DEFAULT KEYBALL_REPORT_RATE_1000HZ
@@ -23,12 +23,49 @@ Copyright 2022 MURAOKA Taro (aka KoRoN)
 #include "keyball.h"
 #include "drivers/pmw3360/pmw3360.h"
 
+#include <stddef.h>
 #include <string.h>
 
 // デフォルトのCPI値と最大CPI値
 const uint8_t CPI_DEFAULT = KEYBALL_CPI_DEFAULT / 100;
 const uint8_t CPI_MAX = pmw3360_MAXCPI + 1;
-const uint8_t SCROLL_DIV_MAX = 7;
+const uint8_t SCROLL_DIV_MAX = 13;
+
+// スクロール除数の段階ごとの実際の除数 (Q4)。半オクターブ(√2倍)刻みで、
+// 奇数番目の段階は以前の2の乗数の除数(1/1〜1/64)と同じになる。
+static const uint16_t scroll_div_q4[] PROGMEM = {16, 23, 32, 45, 64, 91, 128, 181, 256, 362, 512, 724, 1024};
+
+// 加速度テーブル: 移動量を4刻みにした32点のゲイン (Q8.8)
+#define ACCEL_LUT_SHIFT 2
+#define ACCEL_LUT_SIZE 32
+
+#define ACCEL_GAIN(s, lo, th, sl, cap) \
+    ((s) < (th) ? (lo) + (256 - (lo)) * (s) / (th) : (256 + (sl) * ((s) - (th))) > (cap) ? (cap) : 256 + (sl) * ((s) - (th)))
+#define ACCEL_GAIN8(i, lo, th, sl, cap) \
+    ACCEL_GAIN(((i) + 0) << ACCEL_LUT_SHIFT, lo, th, sl, cap), ACCEL_GAIN(((i) + 1) << ACCEL_LUT_SHIFT, lo, th, sl, cap), \
+    ACCEL_GAIN(((i) + 2) << ACCEL_LUT_SHIFT, lo, th, sl, cap), ACCEL_GAIN(((i) + 3) << ACCEL_LUT_SHIFT, lo, th, sl, cap), \
+    ACCEL_GAIN(((i) + 4) << ACCEL_LUT_SHIFT, lo, th, sl, cap), ACCEL_GAIN(((i) + 5) << ACCEL_LUT_SHIFT, lo, th, sl, cap), \
+    ACCEL_GAIN(((i) + 6) << ACCEL_LUT_SHIFT, lo, th, sl, cap), ACCEL_GAIN(((i) + 7) << ACCEL_LUT_SHIFT, lo, th, sl, cap)
+#define KEYBALL_ACCEL_PROFILE(lo, th, sl, cap) \
+    { ACCEL_GAIN8(0, lo, th, sl, cap), ACCEL_GAIN8(8, lo, th, sl, cap), ACCEL_GAIN8(16, lo, th, sl, cap), ACCEL_GAIN8(24, lo, th, sl, cap) }
+
+static const uint16_t accel_lut[][ACCEL_LUT_SIZE] PROGMEM = {
+    KEYBALL_ACCEL_PROFILES
+};
+
+#define ACCEL_PROFILE_COUNT (sizeof(accel_lut) / sizeof(accel_lut[0]))
+
+// 速度の基準: 500CPIで8msあたりのカウント数。従来の125Hz・デフォルトCPIでの
+// 1レポートあたりの移動量と同じ尺度なので、加速度プロファイルの値をそのまま使える。
+#define ACCEL_REF_CPI 5        // 基準CPI (x100)
+#define ACCEL_REF_US 8000      // 基準時間(us)
+#define ACCEL_SPEED_FRAC 4     // 速度の小数部のビット数
+#define ACCEL_DT_MIN_US 250    // 速度計算の最小時間幅(us)
+#define ACCEL_DT_MAX_US 32000  // これより間が空いたら動き出しとみなす(us)
+
+#if (EECONFIG_KB_DATA_SIZE) > 0
+_Static_assert(sizeof(keyball_datablock_t) <= (EECONFIG_KB_DATA_SIZE), "keyball_datablock_t exceeds EECONFIG_KB_DATA_SIZE");
+#endif
 
 // オートマウスレイヤーのタイムアウト設定
 const uint16_t AML_TIMEOUT_MIN = 100;
@@ -47,15 +84,46 @@ keyball_t keyball = {
 
     .this_motion = {0},
     .that_motion = {0},
+    .that_motion_width = 1,
+    .this_filter = {{{0}}},
+    .move_carry = {{{0}}},
+    .scroll_carry = {{{0}}},
+#if KEYBALL_KINETIC_SCROLL_ENABLE
+    .kinetic = {{0}},
+#endif
+    .frame_us = {0},
+    .velocity = {{0}},
 
     .cpi_value = 0,
     .cpi_changed = false,
 
+    .accel_profile = 0,
+
+    .report_rate = 0,
+    .motion_last = 0,
+
+    .key_us = 0,
+    .report_us = 0,
+
+    .rest_mode = KEYBALL_PMW3360_REST_ENABLE,
+
+    .orient = {{0}, {0}},
+    .this_angle = {0},
+    .that_angle_changed = false,
+
+    .this_lifted = false,
+    .this_surface = {0},
+    .lift_cutoff = 0,
+    .lift_calibrating = false,
+
     .scroll_mode = false,
+    .motion_mode = KEYBALL_MOTION_MODE_POINTER,
     .scroll_div = 0,
+    .scroll_div_h = 0,
 
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
     .scrollsnap_mode = KEYBALL_SCROLLSNAP_MODE_VERTICAL, // デフォルトを垂直に設定
+    .scrollsnap_auto = {{.axis = KEYBALL_SCROLLSNAP_MODE_FREE}, {.axis = KEYBALL_SCROLLSNAP_MODE_FREE}},
 #endif
 
     .last_kc = 0,
@@ -88,14 +156,6 @@ static int16_t add16(int16_t a, int16_t b)
     return r;
 }
 
-// divmod16は*vをdivで割り、商を返し、余りを*vに代入します。
-static int16_t divmod16(int16_t *v, int16_t div)
-{
-    int16_t r = *v / div;
-    *v -= r * div;
-    return r;
-}
-
 // clip2int8はint16_tをint8_tにクリップします。
 static inline int8_t clip2int8(int16_t v)
 {
@@ -103,40 +163,59 @@ static inline int8_t clip2int8(int16_t v)
                                          : (int8_t)v;
 }
 
+// clip8はint16_tをint8_tにクリップします。
+static inline int8_t clip8(int16_t v)
+{
+    return v < INT8_MIN ? INT8_MIN : v > INT8_MAX ? INT8_MAX : (int8_t)v;
+}
+
+// clip16はint32_tをint16_tにクリップします。
+static inline int16_t clip16(int32_t v)
+{
+    return v < -32768 ? -32768 : v > 32767 ? 32767 : (int16_t)v;
+}
+
+// clip2xyはint16_tをマウスレポートのX/Yの範囲にクリップします。
+// MOUSE_EXTENDED_REPORTが有効な場合は16ビット、そうでなければ8ビットになる。
+static inline mouse_xy_report_t clip2xy(int16_t v)
+{
+#ifdef MOUSE_EXTENDED_REPORT
+    return v < -32767 ? -32767 : v;
+#else
+    return clip2int8(v);
+#endif
+}
+
 #ifdef OLED_ENABLE
-// 4桁の整数をフォーマットします。
-static const char *format_4d(int8_t d)
+// 4桁の整数をフォーマットします。範囲外の値は-999~9999に丸めます。
+static const char *format_4d(int16_t d)
 {
     static char buf[5] = {0}; // 最大幅 (4) + NUL (1)
     char lead = ' ';
     if (d < 0)
     {
-        d = -d;
+        d = d < -999 ? 999 : -d;
         lead = '-';
     }
-    buf[3] = (d % 10) + '0';
-    d /= 10;
-    if (d == 0)
+    else if (d > 9999)
     {
-        buf[2] = lead;
-        lead = ' ';
+        d = 9999;
     }
-    else
-    {
-        buf[2] = (d % 10) + '0';
-        d /= 10;
-    }
-    if (d == 0)
-    {
-        buf[1] = lead;
-        lead = ' ';
-    }
-    else
+    buf[3] = (d % 10) + '0';
+    d /= 10;
+    for (int8_t i = 2; i >= 0; i--)
     {
-        buf[1] = (d % 10) + '0';
-        d /= 10;
+        if (d == 0)
+        {
+            buf[i] = lead;
+            lead = ' ';
+        }
+        else
+        {
+            buf[i] = (d % 10) + '0';
+            d /= 10;
+        }
     }
-    buf[0] = lead;
     return buf;
 }
 
@@ -168,29 +247,91 @@ static void add_scroll_div(int8_t delta)
 #if KEYBALL_MODEL == 46
 void keyboard_pre_init_kb(void)
 {
-    keyball.this_have_ball = pmw3360_init();
+    // Keyball46は左右判定にボールの有無を使うため、ここで存在だけ確認する
+    keyball.this_have_ball = pmw3360_probe();
     keyboard_pre_init_user();
 }
 #endif
 
-void pointing_device_driver_init(void)
-{
-#if KEYBALL_MODEL != 46
-    keyball.this_have_ball = pmw3360_init();
-#endif
-    if (keyball.this_have_ball)
-    {
 #if defined(KEYBALL_PMW3360_UPLOAD_SROM_ID)
 #if KEYBALL_PMW3360_UPLOAD_SROM_ID == 0x04
-        pmw3360_srom_upload(pmw3360_srom_0x04);
+#define KEYBALL_PMW3360_SROM pmw3360_srom_0x04
 #elif KEYBALL_PMW3360_UPLOAD_SROM_ID == 0x81
-        pmw3360_srom_upload(pmw3360_srom_0x81);
+#define KEYBALL_PMW3360_SROM pmw3360_srom_0x81
 #else
 #error Invalid value for KEYBALL_PMW3360_UPLOAD_SROM_ID. Please choose 0x04 or 0x81 or disable it.
 #endif
 #endif
-        pmw3360_cpi_set(CPI_DEFAULT - 1);
+
+// センサーの準備が完了した時に呼ばれる
+static void pmw3360_on_ready(bool ok)
+{
+#if defined(KEYBALL_PMW3360_UPLOAD_SROM_ID)
+    if (!ok)
+    {
+        dprintf("keyball:pmw3360_on_ready: SROM check failed, ID=0x%02x\n", pmw3360_srom_id);
+    }
+#endif
+    // EEPROMから読み込んだCPIとレストモードを適用
+    keyball.this_cpi_pending = true;
+    keyball.this_angle_pending = true;
+    keyball.this_rest_pending = true;
+    if (keyball.lift_cutoff != 0 && !pmw3360_lift_cutoff_set(keyball.lift_cutoff))
+    {
+        dprintf("keyball:pmw3360_on_ready: queue full, lift cutoff not applied\n");
     }
+#if defined(PMW3360_SAMPLE_RATE)
+    // タイマー割り込みによる一定周期のサンプリングを開始
+    pmw3360_sampler_squal_min_set(KEYBALL_SQUAL_MIN);
+    pmw3360_sampler_start();
+#endif
+}
+
+// センサーの初期化完了時に呼ばれる
+static void pmw3360_on_init(bool ok)
+{
+    keyball.this_have_ball = ok;
+    if (keyball.this_have_ball)
+    {
+#if defined(KEYBALL_PMW3360_UPLOAD_SROM_ID)
+        // SROMはキー入力が有効になった後にアップロードする。
+        // SROM本体の送信(約70ms)の間だけはキーの処理も止まる。
+        // 完了するまでポインターは動かない。
+        pmw3360_srom_upload_async(KEYBALL_PMW3360_SROM, pmw3360_on_ready);
+#else
+        pmw3360_on_ready(true);
+#endif
+    }
+    // ボールの有無が確定したのでレイアウトを再調整
+    keyball_on_adjust_layout(KEYBALL_ADJUST_PENDING);
+}
+
+#if defined(KEYBALL_PMW3360_UPLOAD_SROM_ID)
+// 起動時のSROMチェック完了時に呼ばれる
+static void pmw3360_on_srom_check(bool ok)
+{
+    if (!ok)
+    {
+        // リセットしてアップロードし直す
+        pmw3360_init_async(pmw3360_on_init);
+        return;
+    }
+    // MCUだけがリセットされ、センサーは期待するSROMで動いている
+    keyball.this_have_ball = true;
+    pmw3360_on_ready(true);
+    keyball_on_adjust_layout(KEYBALL_ADJUST_PENDING);
+}
+#endif
+
+void pointing_device_driver_init(void)
+{
+    // メインループを止めないよう非同期で初期化する
+#if defined(KEYBALL_PMW3360_UPLOAD_SROM_ID)
+    // 期待するSROMが既に動いていれば、リセットとアップロードを省略する
+    pmw3360_srom_check_async(KEYBALL_PMW3360_SROM, pmw3360_on_srom_check);
+#else
+    pmw3360_init_async(pmw3360_on_init);
+#endif
 }
 
 uint16_t pointing_device_driver_get_cpi(void)
@@ -203,29 +344,76 @@ void pointing_device_driver_set_cpi(uint16_t cpi)
     keyball_set_cpi(cpi);
 }
 
-static void scale_mouse_movement(keyball_motion_t *m)
+// mul_q88はvにQ8.8のゲインを掛けます。
+// 前回の端数*remを加えてから割り、今回の端数を*remに残すので、小さな動きも失われない。
+static inline int16_t mul_q88(int16_t v, uint16_t gain, int16_t *rem)
 {
-    int16_t movement_size = abs(m->x) + abs(m->y);
+    int32_t t = (int32_t)v * gain + *rem;
+    int32_t r = t / 256;
+    *rem = t - r * 256;
+    return r > 32767 ? 32767 : r < -32768 ? -32768 : (int16_t)r;
+}
+
+// update_velocityは前回からの動きと経過時間から速度を求め、平滑化して返します。
+// 速度はCPIで正規化するので、CPIやレポートレートを変えても加速度の効き方は変わらない。
+static uint16_t update_velocity(keyball_velocity_t *v, const keyball_motion_t *m, uint32_t frame_us)
+{
+    uint32_t dt = frame_us - v->last_us;
+    bool restart = dt > ACCEL_DT_MAX_US;
+    v->last_us = frame_us;
+    if (restart)
+    {
+        // 止まっていたボールの最初の動きは、いつから溜まったものか分からない
+        dt = ACCEL_DT_MAX_US;
+    }
+    else if (dt < ACCEL_DT_MIN_US)
+    {
+        dt = ACCEL_DT_MIN_US;
+    }
+
+    uint32_t counts = abs(m->x) + abs(m->y);
+    if (counts > 2047)
+    {
+        counts = 2047;
+    }
+    uint32_t raw = counts * ((uint32_t)ACCEL_REF_CPI * ACCEL_REF_US << ACCEL_SPEED_FRAC) / ((uint32_t)keyball_get_cpi() * dt);
+    if (raw > UINT16_MAX)
+    {
+        raw = UINT16_MAX;
+    }
 
-    const float speed_multipliers[] = {0.1, 0.4, 0.6, 0.8, 1.0, 1.5, 3.0};
-    const int thresholds[] = {1, 2, 3, 4, 5, 30, 60};
-    const int num_thresholds = sizeof(thresholds) / sizeof(thresholds[0]);
+    // 直近2回分の指数移動平均でフレームのばらつきを均す
+    v->speed = restart ? raw : ((uint32_t)v->speed + raw + 1) >> 1;
+    return v->speed;
+}
 
-    float speed_multiplier = 1.0;
-    for (int i = 0; i < num_thresholds; ++i)
+// scale_mouse_movementはボールの速度に応じたゲインを動きに掛けます。
+// ゲインは加速度テーブルを線形補間して求め、浮動小数点演算は使わない。
+static void scale_mouse_movement(keyball_motion_t *m, keyball_motion_t *rem, keyball_velocity_t *v, uint32_t frame_us)
+{
+    if (m->x == 0 && m->y == 0)
     {
-        if (movement_size > thresholds[i])
-        {
-            speed_multiplier = speed_multipliers[i];
-        }
-        else
-        {
-            break;
-        }
+        return;
+    }
+    uint16_t speed = update_velocity(v, m, frame_us);
+    const uint16_t *lut = accel_lut[keyball_get_accel_profile()];
+
+    uint16_t i = speed >> (ACCEL_SPEED_FRAC + ACCEL_LUT_SHIFT);
+    uint16_t gain;
+    if (i >= ACCEL_LUT_SIZE - 1)
+    {
+        gain = pgm_read_word(&lut[ACCEL_LUT_SIZE - 1]);
+    }
+    else
+    {
+        uint16_t g0 = pgm_read_word(&lut[i]);
+        uint16_t g1 = pgm_read_word(&lut[i + 1]);
+        int32_t  f = speed & ((1 << (ACCEL_SPEED_FRAC + ACCEL_LUT_SHIFT)) - 1);
+        gain = g0 + (((int32_t)(int16_t)(g1 - g0) * f) >> (ACCEL_SPEED_FRAC + ACCEL_LUT_SHIFT));
     }
 
-    m->x = clip2int8((int16_t)(m->x * speed_multiplier));
-    m->y = clip2int8((int16_t)(m->y * speed_multiplier));
+    m->x = mul_q88(m->x, gain, &rem->x);
+    m->y = mul_q88(m->y, gain, &rem->y);
 }
 
 uint8_t keyball_get_scroll_reverse_mode(void)
@@ -241,23 +429,107 @@ void keyball_set_scroll_reverse_mode(keyball_scroll_t mode)
     }
 }
 
-__attribute__((weak)) void keyball_on_apply_motion_to_mouse_move(keyball_motion_t *m, report_mouse_t *r, bool is_left)
+// orient_computeはボールの向きの設定から軸の変換とセンサーの角度を計算します。
+static keyball_angle_t orient_compute(bool is_left, keyball_xform_t *xf)
 {
-    scale_mouse_movement(m); // マウスの加速度を追加
-#if KEYBALL_MODEL == 61 || KEYBALL_MODEL == 39 || KEYBALL_MODEL == 147 || KEYBALL_MODEL == 44
-    r->x = clip2int8(m->y);
-    r->y = clip2int8(m->x);
-    if (is_left)
+    const keyball_orient_t *o = &keyball.orient[is_left];
+
+    // 角度を-180~179度に正規化し、90度単位の回転と残りの微調整に分ける
+    int16_t deg = o->angle % 360;
+    if (deg < -180)
     {
-        r->x = -r->x;
-        r->y = -r->y;
+        deg += 360;
     }
+    else if (deg >= 180)
+    {
+        deg -= 360;
+    }
+    int8_t quarter = (deg + (deg >= 0 ? 45 : -45)) / 90;
+    int8_t fine = deg - quarter * 90;
+
+    // モデルごとのセンサーの取り付け向き: (x, y) = (a*mx + b*my, c*mx + d*my)
+#if KEYBALL_MODEL == 61 || KEYBALL_MODEL == 39 || KEYBALL_MODEL == 147 || KEYBALL_MODEL == 44
+    int8_t s = is_left ? -1 : 1;
+    int8_t a = 0, b = s, c = s, d = 0;
 #elif KEYBALL_MODEL == 46
-    r->x = clip2int8(m->x);
-    r->y = -clip2int8(m->y);
+    int8_t a = 1, b = 0, c = 0, d = -1;
 #else
 #error "unknown Keyball model"
 #endif
+
+    // 90度ずつ時計回りに回転: (x, y) → (-y, x)
+    for (uint8_t i = quarter & 3; i > 0; i--)
+    {
+        int8_t ta = a, tb = b;
+        a = -c;
+        b = -d;
+        c = ta;
+        d = tb;
+    }
+    if (o->mirror)
+    {
+        a = -a;
+        b = -b;
+    }
+
+    xf->swap = a == 0;
+    xf->sx = xf->swap ? b : a;
+    xf->sy = xf->swap ? c : d;
+
+    // 画面とセンサーの座標系の向きが揃っていれば(行列式が負)、
+    // Angle_Tuneの回転方向は画面上の回転方向と一致する
+    keyball_angle_t angle = {
+        .tune = (a * d - b * c) < 0 ? fine : -fine,
+        .snap = o->snap,
+    };
+    return angle;
+}
+
+// orient_updateはボールの向きの変更を軸の変換とセンサーに反映します。
+static void orient_update(void)
+{
+    keyball.this_angle = orient_compute(is_keyboard_left(), &keyball.xform[is_keyboard_left()]);
+    orient_compute(!is_keyboard_left(), &keyball.xform[!is_keyboard_left()]);
+    keyball.this_angle_pending = true;
+    keyball.that_angle_changed = true;
+}
+
+// apply_xformは事前計算した変換でセンサーの動きを画面上の向きに変換します。
+static inline void apply_xform(const keyball_xform_t *xf, int16_t mx, int16_t my, int16_t *x, int16_t *y)
+{
+    int16_t u = xf->swap ? my : mx;
+    int16_t v = xf->swap ? mx : my;
+    *x = xf->sx < 0 ? -u : u;
+    *y = xf->sy < 0 ? -v : v;
+}
+
+// unapply_xformはapply_xformの逆で、画面上の向きの動きをセンサーの向きに戻します。
+static inline void unapply_xform(const keyball_xform_t *xf, int16_t x, int16_t y, int16_t *mx, int16_t *my)
+{
+    int16_t u = xf->sx < 0 ? -x : x;
+    int16_t v = xf->sy < 0 ? -y : y;
+    *mx = xf->swap ? v : u;
+    *my = xf->swap ? u : v;
+}
+
+__attribute__((weak)) void keyball_on_apply_motion_to_mouse_move(keyball_motion_t *m, report_mouse_t *r, bool is_left)
+{
+    keyball_carry_t *c = &keyball.move_carry[is_left];
+    scale_mouse_movement(m, &c->rem, &keyball.velocity[is_left], keyball.frame_us[is_left]); // マウスの加速度を追加
+
+    // 前回送りきれなかった分を加え、レポートに収まらない分は次回に持ち越す。
+    // MOUSE_EXTENDED_REPORTが有効なら、高CPIの速い動きでも持ち越さずに送れる。
+    int16_t mx = add16(m->x, c->excess.x);
+    int16_t my = add16(m->y, c->excess.y);
+    int16_t sx = clip2xy(mx);
+    int16_t sy = clip2xy(my);
+    c->excess.x = mx - sx;
+    c->excess.y = my - sy;
+
+    int16_t x, y;
+    apply_xform(&keyball.xform[is_left], sx, sy, &x, &y);
+    r->x = x;
+    r->y = y;
     // 動きをクリア
     m->x = 0;
     m->y = 0;
@@ -275,27 +547,136 @@ static void motion_to_mouse(keyball_motion_t *m, report_mouse_t *r, bool is_left
     }
 }
 
+// report_intervalは操作中のマウスレポート間隔(ms)を返します。
+static uint8_t report_interval(void)
+{
+    uint8_t interval = 8 >> keyball_get_report_rate();
+#ifdef USB_POLLING_INTERVAL_MS
+    // USBのエンドポイントのポーリング間隔より短くしても意味がない
+    if (interval < USB_POLLING_INTERVAL_MS)
+    {
+        interval = USB_POLLING_INTERVAL_MS;
+    }
+#endif
+    return interval;
+}
+
+static inline bool has_motion(void)
+{
+#if KEYBALL_KINETIC_SCROLL_ENABLE
+    if (keyball.kinetic[0].coasting || keyball.kinetic[1].coasting)
+    {
+        return true;
+    }
+#endif
+    if (keyball.held[0].x != 0 || keyball.held[0].y != 0 || keyball.held[1].x != 0 || keyball.held[1].y != 0)
+    {
+        return true;
+    }
+    return keyball.this_motion.x != 0 || keyball.this_motion.y != 0 || keyball.that_motion.x != 0 || keyball.that_motion.y != 0 || keyball.move_carry[0].excess.x != 0 || keyball.move_carry[0].excess.y != 0 || keyball.move_carry[1].excess.x != 0 || keyball.move_carry[1].excess.y != 0;
+}
+
 static inline bool should_report(void)
 {
     uint32_t now = timer_read32();
-#if defined(KEYBALL_REPORTMOUSE_INTERVAL) && KEYBALL_REPORTMOUSE_INTERVAL > 0
-    // マウスレポートレートをスロットリング
-    static uint32_t last = 0;
-    if (TIMER_DIFF_32(now, last) < KEYBALL_REPORTMOUSE_INTERVAL)
+    uint32_t now_us = keyball_timer_us();
+    // マウスレポートレートをスロットリング。1kHzでも刻みが粗くならないようusで測る。
+    // 無操作が続いた後、動き出した最初のレポートは待たずに送る。
+    bool wake = false;
+    if (has_motion())
+    {
+        wake = TIMER_DIFF_32(now, keyball.motion_last) >= KEYBALL_REPORT_IDLE_TIMEOUT;
+        keyball.motion_last = now;
+    }
+    if (!wake && now_us - keyball.report_us < (uint32_t)report_interval() * 1000)
     {
         return false;
     }
-    last = now;
-#endif
-#if defined(KEYBALL_SCROLLBALL_INHIVITOR) && KEYBALL_SCROLLBALL_INHIVITOR > 0
-    if (TIMER_DIFF_32(now, keyball.scroll_mode_changed) < KEYBALL_SCROLLBALL_INHIVITOR)
+    keyball.report_us = now_us;
+    return true;
+}
+
+// hold_motionは遷移中に溜めた動きをthis_motion/that_motionから取り出し、
+// 溜めたのと同じ時間(duration ms)をかけて送るように予約します。
+// 保留時間が過ぎた瞬間にまとめて送ると、ポインターやスクロールが跳ぶため。
+static void hold_motion(uint32_t now, uint16_t duration)
+{
+    keyball_motion_t *src[2];
+    src[is_keyboard_left()]  = &keyball.this_motion;
+    src[!is_keyboard_left()] = &keyball.that_motion;
+    ATOMIC_BLOCK_FORCEON
     {
-        keyball.this_motion.x = 0;
-        keyball.this_motion.y = 0;
-        keyball.that_motion.x = 0;
-        keyball.that_motion.y = 0;
+        for (uint8_t i = 0; i < 2; i++)
+        {
+            keyball.held[i].x = add16(keyball.held[i].x, src[i]->x);
+            keyball.held[i].y = add16(keyball.held[i].y, src[i]->y);
+            src[i]->x = 0;
+            src[i]->y = 0;
+        }
+    }
+    keyball.held_last  = now;
+    keyball.held_until = now + duration;
+}
+
+// release_heldは予約した動きのうち、前回から経過した時間の分をthis_motion/that_motionに戻します。
+static void release_held(uint32_t now)
+{
+    if (keyball.held[0].x == 0 && keyball.held[0].y == 0 && keyball.held[1].x == 0 && keyball.held[1].y == 0)
+    {
+        return;
+    }
+    uint32_t span = keyball.held_until - keyball.held_last;
+    uint32_t dt   = TIMER_DIFF_32(now, keyball.held_last);
+    keyball.held_last = now;
+    keyball_motion_t *dst[2];
+    dst[is_keyboard_left()]  = &keyball.this_motion;
+    dst[!is_keyboard_left()] = &keyball.that_motion;
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        keyball_motion_t d = keyball.held[i];
+        if (dt < span)
+        {
+            d.x = (int32_t)d.x * (int32_t)dt / (int32_t)span;
+            d.y = (int32_t)d.y * (int32_t)dt / (int32_t)span;
+        }
+        keyball.held[i].x -= d.x;
+        keyball.held[i].y -= d.y;
+        ATOMIC_BLOCK_FORCEON
+        {
+            dst[i]->x = add16(dst[i]->x, d.x);
+            dst[i]->y = add16(dst[i]->y, d.y);
+        }
+    }
+}
+
+// motion_mode_updateはスクロールモード切替後の遷移を進め、動きを送ってよいかを返します。
+// 遷移中の動きは捨てずにthis_motion/that_motionに溜めておき、
+// 保留時間が過ぎたら切替後のモードで、同じ時間をかけて送る。
+static bool motion_mode_update(void)
+{
+    uint32_t now     = timer_read32();
+    uint32_t elapsed = TIMER_DIFF_32(now, keyball.motion_mode_changed);
+    switch (keyball.motion_mode)
+    {
+    case KEYBALL_MOTION_MODE_TO_SCROLL:
+        if (elapsed < KEYBALL_TRANSITION_TO_SCROLL)
+        {
+            return false;
+        }
+        keyball.motion_mode = KEYBALL_MOTION_MODE_SCROLL;
+        hold_motion(now, KEYBALL_TRANSITION_TO_SCROLL);
+        break;
+    case KEYBALL_MOTION_MODE_TO_POINTER:
+        if (elapsed < KEYBALL_TRANSITION_TO_POINTER)
+        {
+            return false;
+        }
+        keyball.motion_mode = KEYBALL_MOTION_MODE_POINTER;
+        hold_motion(now, KEYBALL_TRANSITION_TO_POINTER);
+        break;
+    default:
+        break;
     }
-#endif
     return true;
 }
 
@@ -330,31 +711,189 @@ void keyboard_post_init_user(void) {
 #endif
 }
 
-__attribute__((weak)) void keyball_on_apply_motion_to_mouse_scroll(keyball_motion_t *m, report_mouse_t *r, bool is_left)
+// scroll_unitsはボールのカウントをホイールの単位に変換します。
+// mult/divは分数の倍率になり、割った端数は*remに、
+// レポートの範囲(±127)に収まらなかった分は*excessに持ち越します。
+static int8_t scroll_units(int16_t counts, uint16_t mult, uint16_t div, int16_t *rem, int16_t *excess)
 {
-    uint32_t now = timer_read32(); // 'now' を定義
+    int32_t t = (int32_t)counts * mult + *rem;
+    int32_t u = t / div;
+    *rem = t - u * div;
+    u += *excess;
+    int8_t r = u < -127 ? -127 : u > 127 ? 127 : (int8_t)u;
+    *excess = clip16(u - r);
+    return r;
+}
+
+#if KEYBALL_SCROLLSNAP_ENABLE == 2
+// snap_auto_resetは自動スナップの軸のロックを解除します。
+static void snap_auto_reset(keyball_snap_t *s)
+{
+    s->acc_h = 0;
+    s->acc_v = 0;
+    s->axis  = KEYBALL_SCROLLSNAP_MODE_FREE;
+}
 
-    // トラックボールの動きを処理する
-    int16_t div = 1 << (keyball_get_scroll_div() - 1);
-    int16_t x = divmod16(&m->x, div);
-    int16_t y = divmod16(&m->y, div);
+// snap_auto_accは動きの量を累積します。溢れないよう上限で止める。
+static inline uint16_t snap_auto_acc(uint16_t acc, int16_t d)
+{
+    uint32_t t = (uint32_t)acc + abs(d);
+    return t > UINT16_MAX ? UINT16_MAX : (uint16_t)t;
+}
 
-    // 通常のスクロール処理
-#if KEYBALL_MODEL == 61 || KEYBALL_MODEL == 39 || KEYBALL_MODEL == 147 || KEYBALL_MODEL == 44
-    r->h = clip2int8(y);  // Y方向の動きを水平方向に適用
-    r->v = -clip2int8(x); // X方向の動きを垂直方向に適用（方向を反転）
-    if (is_left)
-    { // 左手用デバイスの場合、方向をさらに反転
-        r->h = -r->h;
-        r->v = -r->v;
+// snap_autoは画面上の動き(h, v)からスナップする軸を判定します。
+// 軸が未決定の間は動きを貯め、一定量に達したら多い方の軸にロックする。
+// ロック中はもう一方の軸が十分に優勢になった時だけ切り替え(ヒステリシス)、
+// 一定時間動きがなければロックを解除する。
+// 未決定の間はKEYBALL_SCROLLSNAP_MODE_FREEを返す。
+static keyball_scrollsnap_mode_t snap_auto(keyball_snap_t *s, int16_t h, int16_t v, uint32_t now)
+{
+    if (h == 0 && v == 0)
+    {
+        if (TIMER_DIFF_32(now, s->last) >= KEYBALL_SCROLLSNAP_AUTO_TIMEOUT)
+        {
+            snap_auto_reset(s);
+        }
+        return s->axis;
     }
-#elif KEYBALL_MODEL == 46
-    r->h = clip2int8(x); // X方向の動きを水平方向に適用
-    r->v = clip2int8(y); // Y方向の動きを垂直方向に適用
-#else
-#error "unknown Keyball model" // 未知のKeyballモデルの場合、コンパイルエラーを出力
+    s->last = now;
+
+    if (s->axis == KEYBALL_SCROLLSNAP_MODE_FREE)
+    {
+        // 最初の動きを貯めて軸を決める。斜めに動き出しても余計なスクロールは出さない。
+        s->acc_h = snap_auto_acc(s->acc_h, h);
+        s->acc_v = snap_auto_acc(s->acc_v, v);
+        if ((uint32_t)s->acc_h + s->acc_v >= KEYBALL_SCROLLSNAP_AUTO_WINDOW)
+        {
+            s->axis  = s->acc_h > s->acc_v ? KEYBALL_SCROLLSNAP_MODE_HORIZONTAL : KEYBALL_SCROLLSNAP_MODE_VERTICAL;
+            s->acc_h = 0;
+            s->acc_v = 0;
+        }
+        return s->axis;
+    }
+
+    // ロック中は古い動きほど軽くなるよう減衰させながら累積する
+    s->acc_h = snap_auto_acc(s->acc_h - (s->acc_h >> 4), h);
+    s->acc_v = snap_auto_acc(s->acc_v - (s->acc_v >> 4), v);
+    uint16_t on  = s->axis == KEYBALL_SCROLLSNAP_MODE_VERTICAL ? s->acc_v : s->acc_h;
+    uint16_t off = s->axis == KEYBALL_SCROLLSNAP_MODE_VERTICAL ? s->acc_h : s->acc_v;
+    if ((uint32_t)off > (uint32_t)on * KEYBALL_SCROLLSNAP_AUTO_RATIO + KEYBALL_SCROLLSNAP_AUTO_WINDOW)
+    {
+        s->axis  = s->axis == KEYBALL_SCROLLSNAP_MODE_VERTICAL ? KEYBALL_SCROLLSNAP_MODE_HORIZONTAL : KEYBALL_SCROLLSNAP_MODE_VERTICAL;
+        s->acc_h = 0;
+        s->acc_v = 0;
+    }
+    return s->axis;
+}
+#endif
+
+#if KEYBALL_KINETIC_SCROLL_ENABLE
+// kinetic_clipは速度を1msあたり±127ホイール単位に収めます。
+static inline int32_t kinetic_clip(int32_t v)
+{
+    return v < -127L * 4096 ? -127L * 4096 : v > 127L * 4096 ? 127L * 4096 : v;
+}
+
+// kinetic_decayは速度vを経過時間dt(us)分だけ摩擦で減速させます。
+// 遅くなっても止まるよう、少なくとも1は減らす。
+static inline int32_t kinetic_decay(int32_t v, uint32_t dt)
+{
+    int32_t d = v * KEYBALL_KINETIC_FRICTION / 1024 * (int32_t)dt / 1000;
+    if (d == 0)
+    {
+        d = v > 0 ? 1 : v < 0 ? -1 : 0;
+    }
+    return v - d;
+}
+
+// kinetic_scrollは慣性スクロールを処理します。
+// ボールが動いている間はスクロールの速度を測り、止まった時の速度が十分なら
+// 摩擦で減速しながら、レポートごとにその速度分のスクロールを*rに加えます。
+// 速度は1msあたりのホイール単位 (1/4096単位) で扱います。
+static void kinetic_scroll(keyball_kinetic_t *k, report_mouse_t *r, bool contact)
+{
+    uint32_t now = keyball_timer_us();
+    uint32_t dt = now - k->last_us;
+    k->last_us = now;
+    if (dt > 32000)
+    {
+        dt = 32000;
+    }
+    else if (dt < 250)
+    {
+        dt = 250;
+    }
+
+    if (contact)
+    {
+        // 直近のフレームの速度の移動平均をとる。新しく触れた時は慣性を止める
+        if (k->coasting || now - k->contact_us > KEYBALL_KINETIC_RELEASE_TIMEOUT * 1000UL)
+        {
+            k->vh = k->vv = 0;
+        }
+        k->vh = kinetic_clip((k->vh + (int32_t)r->h * 4096000 / (int32_t)dt) / 2);
+        k->vv = kinetic_clip((k->vv + (int32_t)r->v * 4096000 / (int32_t)dt) / 2);
+        k->contact_us = now;
+        k->coasting = false;
+        return;
+    }
+
+    if (!k->coasting)
+    {
+        if (k->vh == 0 && k->vv == 0)
+        {
+            return;
+        }
+        // ボールが止まってから少し待ち、離された時の速度が十分なら慣性スクロールを始める
+        if (now - k->contact_us < KEYBALL_KINETIC_RELEASE_TIMEOUT * 1000UL)
+        {
+            return;
+        }
+        if ((uint32_t)(labs(k->vh) + labs(k->vv)) * 1000 < (uint32_t)KEYBALL_KINETIC_MIN_SPEED * 4096)
+        {
+            k->vh = k->vv = 0;
+            return;
+        }
+        k->coasting = true;
+        k->rem_h = k->rem_v = 0;
+    }
+
+    // 経過時間分のスクロールを加え、摩擦で減速する
+    int32_t th = k->vh * (int32_t)(dt >> 3) / 125 + k->rem_h;
+    int32_t tv = k->vv * (int32_t)(dt >> 3) / 125 + k->rem_v;
+    k->rem_h = th % 4096;
+    k->rem_v = tv % 4096;
+    r->h = clip2int8(r->h + th / 4096);
+    r->v = clip2int8(r->v + tv / 4096);
+    k->vh = kinetic_decay(k->vh, dt);
+    k->vv = kinetic_decay(k->vv, dt);
+    if ((uint32_t)(labs(k->vh) + labs(k->vv)) * 1000 < (uint32_t)KEYBALL_KINETIC_STOP_SPEED * 4096)
+    {
+        k->vh = k->vv = 0;
+        k->coasting = false;
+    }
+}
 #endif
 
+__attribute__((weak)) void keyball_on_apply_motion_to_mouse_scroll(keyball_motion_t *m, report_mouse_t *r, bool is_left)
+{
+#if KEYBALL_SCROLLSNAP_ENABLE > 0
+    uint32_t now = timer_read32(); // 'now' を定義
+#endif
+
+    // 通常のスクロール処理: 画面上の横の動きを水平方向、縦の動きを垂直方向(上が正)に適用
+    int16_t h, v;
+    apply_xform(&keyball.xform[is_left], m->x, m->y, &h, &v);
+    m->x = 0;
+    m->y = 0;
+
+    // ホイールのノッチに変換する。除数はQ4なのでカウントも16倍して割る。
+    keyball_carry_t *c = &keyball.scroll_carry[is_left];
+    uint16_t div_h = pgm_read_word(&scroll_div_q4[keyball_get_scroll_div_h() - 1]);
+    uint16_t div_v = pgm_read_word(&scroll_div_q4[keyball_get_scroll_div() - 1]);
+    r->h = scroll_units(h, 16, div_h, &c->rem.x, &c->excess.x);
+    r->v = scroll_units(-v, 16, div_v, &c->rem.y, &c->excess.y);
+
     // スクロールスナップ機能を適用する（スクロールの引っ掛かり効果を追加）
 #if KEYBALL_SCROLLSNAP_ENABLE == 1
     // 旧バージョンのスナップ機能（バージョン1.3.2まで）
@@ -368,18 +907,41 @@ __attribute__((weak)) void keyball_on_apply_motion_to_mouse_scroll(keyball_motio
     }
     if (abs(keyball.scroll_snap_tension_h) < KEYBALL_SCROLLSNAP_TENSION_THRESHOLD)
     {
-        keyball.scroll_snap_tension_h += y; // 張力を増加させて引っ掛かり効果を再現
+        keyball.scroll_snap_tension_h += h; // 張力を増加させて引っ掛かり効果を再現
         r->h = 0;                           // スクロール方向は固定
+        c->rem.x = c->excess.x = 0;
     }
 #elif KEYBALL_SCROLLSNAP_ENABLE == 2
     // 新バージョンのスナップ機能
-    switch (keyball_get_scrollsnap_mode())
+    keyball_scrollsnap_mode_t snap = keyball_get_scrollsnap_mode();
+    if (snap == KEYBALL_SCROLLSNAP_MODE_AUTO)
+    {
+        keyball_snap_t *s = &keyball.scrollsnap_auto[is_left];
+        snap = snap_auto(s, h, v, now);
+        if (snap == KEYBALL_SCROLLSNAP_MODE_FREE && s->acc_h == 0 && s->acc_v == 0)
+        {
+            // 軸が決まらないままロックが解除されたら、貯めていた分は捨てる
+            c->rem.x = c->excess.x = 0;
+            c->rem.y = c->excess.y = 0;
+        }
+        else if (snap == KEYBALL_SCROLLSNAP_MODE_FREE)
+        {
+            // 軸が決まるまでは送らずに持ち越し、ロックした軸の分だけ後で送る
+            c->excess.x = clip16((int32_t)c->excess.x + r->h);
+            c->excess.y = clip16((int32_t)c->excess.y + r->v);
+            r->h = 0;
+            r->v = 0;
+        }
+    }
+    switch (snap)
     {
     case KEYBALL_SCROLLSNAP_MODE_VERTICAL:
         r->h = 0; // 水平方向の動きを無効化（縦方向のみにスクロール）
+        c->rem.x = c->excess.x = 0;
         break;
     case KEYBALL_SCROLLSNAP_MODE_HORIZONTAL:
         r->v = 0; // 垂直方向の動きを無効化（横方向のみにスクロール）
+        c->rem.y = c->excess.y = 0;
         break;
     default:
         // 何もしない
@@ -387,14 +949,9 @@ __attribute__((weak)) void keyball_on_apply_motion_to_mouse_scroll(keyball_motio
     }
 #endif
 
-#if defined(KEYBALL_SCROLLBALL_INHIVITOR) && KEYBALL_SCROLLBALL_INHIVITOR > 0
-    if (TIMER_DIFF_32(now, keyball.scroll_mode_changed) < KEYBALL_SCROLLBALL_INHIVITOR)
-    {
-        keyball.this_motion.x = 0;
-        keyball.this_motion.y = 0;
-        keyball.that_motion.x = 0;
-        keyball.that_motion.y = 0;
-    }
+#if KEYBALL_KINETIC_SCROLL_ENABLE
+    // ボールを離した後も慣性でスクロールを続ける
+    kinetic_scroll(&keyball.kinetic[is_left], r, h != 0 || v != 0);
 #endif
 
    // スクロール方向の逆転処理
@@ -409,24 +966,230 @@ __attribute__((weak)) void keyball_on_apply_motion_to_mouse_scroll(keyball_motio
 
 }
 
+#if KEYBALL_FILTER_MEDIAN
+// med3は3つの値の中央値を返します。
+static inline int16_t med3(int16_t a, int16_t b, int16_t c)
+{
+    if (a > b)
+    {
+        int16_t t = a;
+        a = b;
+        b = t;
+    }
+    return c < a ? a : c > b ? b : c;
+}
+#endif
+
+// lowpassは係数alpha(1/256単位)でvを平滑化し、整数にした値を返します。
+static inline int16_t lowpass(int16_t *lp, int16_t *rem, int16_t v, uint16_t alpha)
+{
+    int16_t target = v > 2047 ? 2047 * 16 : v < -2047 ? -2047 * 16 : v * 16;
+    *lp += ((int32_t)target - *lp) * alpha / 256;
+    int16_t t = *lp + *rem;
+    int16_t r = t / 16;
+    *rem = t - r * 16;
+    return r;
+}
+
+// filter_flushは動きが止まっていたら、中央値とローパスで遅らせている動きを返して
+// 静止状態に戻ります。これでジェスチャー全体の動きの合計は、捨てた突発的な値を除いて
+// センサーのカウントの合計と一致する。
+// デッドゾーンを超えていなければ送らずに溜め、次に動き出した時に送る。
+// 返す動きがあればtrueを返します。
+static bool filter_flush(keyball_filter_t *f, int16_t *x, int16_t *y, uint32_t now_us)
+{
+    *x = 0;
+    *y = 0;
+    if (!f->running || now_us - f->last_us <= KEYBALL_FILTER_IDLE_TIMEOUT * 1000UL)
+    {
+        return false;
+    }
+    keyball_motion_t owed    = f->owed;
+    keyball_motion_t pending = f->pending;
+    bool             active  = f->active;
+    memset(f, 0, sizeof(*f));
+    f->pending = pending;
+#if KEYBALL_FILTER_DEADZONE > 0
+    if (!active)
+    {
+        f->pending.x = add16(f->pending.x, owed.x);
+        f->pending.y = add16(f->pending.y, owed.y);
+        return false;
+    }
+#else
+    (void)active;
+#endif
+    *x = owed.x;
+    *y = owed.y;
+    return owed.x != 0 || owed.y != 0;
+}
+
+#if KEYBALL_FILTER_MEDIAN
+// is_spikeはフレームの値vが中央値mから突発的に飛び出しているかを返します。
+static inline bool is_spike(int16_t v, int16_t m)
+{
+    int32_t d = (int32_t)v - m;
+    return d > KEYBALL_FILTER_SPIKE || d < -KEYBALL_FILTER_SPIKE;
+}
+#endif
+
+// filter_motionはセンサーのフレームの動きにフィルターを掛けます。
+// 1フレームあたりの処理量は一定で、静止中の微小なノイズでは動きを出さない。
+// 動きが残った場合にtrueを返します。
+static bool filter_motion(keyball_filter_t *f, int16_t *x, int16_t *y, uint32_t now_us)
+{
+    // 前のフレームから時間が空いていたら、遅らせていた動きを先に出して静止状態に戻る
+    int16_t fx, fy;
+    filter_flush(f, &fx, &fy, now_us);
+    if (!f->running)
+    {
+        // 中央値フィルターは最初のフレームをそのまま通すようにする
+        f->running   = true;
+        f->hist[0].x = f->hist[1].x = *x;
+        f->hist[0].y = f->hist[1].y = *y;
+    }
+    f->last_us = now_us;
+    // フィルターに入れる動き。出した動きとの差は遅れとして溜めておく
+    int16_t in_x = *x;
+    int16_t in_y = *y;
+
+#if KEYBALL_FILTER_MEDIAN
+    // 1フレームだけ飛び出した値を捨てる
+    int16_t mx = med3(f->hist[0].x, f->hist[1].x, *x);
+    int16_t my = med3(f->hist[0].y, f->hist[1].y, *y);
+    f->hist[0] = f->hist[1];
+    f->hist[1].x = *x;
+    f->hist[1].y = *y;
+    // 中央値との小さな差は1フレームの遅れなので後で出す。大きな差は突発的な値として捨てる
+    if (is_spike(in_x, mx))
+    {
+        in_x = mx;
+    }
+    if (is_spike(in_y, my))
+    {
+        in_y = my;
+    }
+#else
+    int16_t mx = *x;
+    int16_t my = *y;
+#endif
+
+#if KEYBALL_FILTER_LOWPASS_MIN < 256
+    // 1€フィルターのように、遅い時は強く平滑化し、速い時は遅れを出さない
+    uint16_t speed = abs(mx) + abs(my);
+    uint32_t alpha = KEYBALL_FILTER_LOWPASS_MIN + (uint32_t)KEYBALL_FILTER_LOWPASS_BETA * speed;
+    if (alpha > 256)
+    {
+        alpha = 256;
+    }
+    mx = lowpass(&f->lp.x, &f->rem.x, mx, alpha);
+    my = lowpass(&f->lp.y, &f->rem.y, my, alpha);
+#endif
+    f->owed.x = clip16((int32_t)f->owed.x + in_x - mx);
+    f->owed.y = clip16((int32_t)f->owed.y + in_y - my);
+
+#if KEYBALL_FILTER_DEADZONE > 0
+    if (!f->active)
+    {
+        // 静止状態では、行ったり来たりするノイズが打ち消し合うよう動きを溜めておく。
+        // 中央値とローパスはノイズの向きを揃えてしまうことがあるので、遅れも含めた
+        // 正味の動きで判定する。
+        f->pending.x = add16(f->pending.x, mx);
+        f->pending.y = add16(f->pending.y, my);
+        if (abs(add16(f->pending.x, f->owed.x)) + abs(add16(f->pending.y, f->owed.y)) < KEYBALL_FILTER_DEADZONE)
+        {
+            *x = fx;
+            *y = fy;
+            return fx != 0 || fy != 0;
+        }
+        f->active  = true;
+        mx         = f->pending.x;
+        my         = f->pending.y;
+        f->pending = (keyball_motion_t){0};
+    }
+#endif
+
+    *x = add16(fx, mx);
+    *y = add16(fy, my);
+    return *x != 0 || *y != 0;
+}
+
+// surface_updateは読み取ったフレームで表面の状態の統計を更新します。
+static void surface_update(const pmw3360_motion_t *d, uint8_t gated)
+{
+    keyball_surface_t *s = &keyball.this_surface;
+    s->squal += ((int16_t)d->squal * 16 - (int16_t)s->squal) / 16;
+    s->shutter += ((int32_t)d->shutter - s->shutter) / 16;
+    // 古いフレームの影響が薄れるよう、溢れる前に半分にする
+    if (s->frames >= 0x8000)
+    {
+        s->frames /= 2;
+        s->gated /= 2;
+    }
+    s->frames++;
+    s->gated += gated;
+}
+
 report_mouse_t pointing_device_driver_get_report(report_mouse_t rep)
 {
     // 光学センサーからデータを取得
     if (keyball.this_have_ball)
     {
         pmw3360_motion_t d = {0};
-        if (pmw3360_motion_burst(&d))
+#if defined(PMW3360_SAMPLE_RATE)
+        // タイマー割り込みで蓄積された動きを取り出すだけ。
+        // リフト中のフレームは割り込み内で捨てられている。
+        // SQUALの低いフレームも割り込み内で捨てられている。
+        bool moved = pmw3360_sampler_drain(&d);
+        keyball.this_lifted = (d.motion & pmw3360_MOTION_LIFT) != 0;
+        uint8_t gated = pmw3360_sampler_gated();
+        if (moved || gated > 0)
+        {
+            surface_update(&d, gated);
+        }
+#else
+        bool moved = pmw3360_motion_burst(&d);
+        // ボールが浮いている(リフト中の)フレームの動きは捨てる
+        keyball.this_lifted = (d.motion & pmw3360_MOTION_LIFT) != 0;
+        moved = moved && !keyball.this_lifted;
+        if (moved)
         {
+            // 表面の状態が悪く、特徴を捉えられていないフレームの動きは捨てる
+            bool gated = d.squal < KEYBALL_SQUAL_MIN;
+            surface_update(&d, gated);
+            moved = !gated;
+        }
+#endif
+        uint32_t now_us = keyball_timer_us();
+        if (moved)
+        {
+            moved = filter_motion(&keyball.this_filter, &d.x, &d.y, now_us);
+        }
+        else if (filter_flush(&keyball.this_filter, &d.x, &d.y, now_us))
+        {
+            // 動きが止まったので、フィルターが遅らせていた分を送りきる
             ATOMIC_BLOCK_FORCEON
             {
                 keyball.this_motion.x = add16(keyball.this_motion.x, d.x);
                 keyball.this_motion.y = add16(keyball.this_motion.y, d.y);
             }
         }
+        if (moved)
+        {
+            ATOMIC_BLOCK_FORCEON
+            {
+                keyball.this_motion.x = add16(keyball.this_motion.x, d.x);
+                keyball.this_motion.y = add16(keyball.this_motion.y, d.y);
+            }
+            // 速度の計算用にフレームを読み取った時刻を記録
+            keyball.frame_us[is_keyboard_left()] = now_us;
+        }
     }
     // キーボードがマスターの場合、マウスイベントを報告
-    if (is_keyboard_master() && should_report())
+    if (is_keyboard_master() && motion_mode_update() && should_report())
     {
+        // 遷移中に溜めた動きを少しずつ戻す
+        release_held(timer_read32());
         // PMW3360の動きに基づいてマウスレポートを修正
         motion_to_mouse(&keyball.this_motion, &rep, is_keyboard_left(), keyball.scroll_mode);
         motion_to_mouse(&keyball.that_motion, &rep, !is_keyboard_left(), keyball.scroll_mode ^ keyball.this_have_ball);
@@ -436,45 +1199,377 @@ report_mouse_t pointing_device_driver_get_report(report_mouse_t rep)
     return rep;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// 状態の複製
+
+#if defined(OLED_ENABLE) || defined(SPLIT_KEYBOARD)
+// state_snapshotはマスターの現在の状態をsに詰めます。
+static void state_snapshot(keyball_state_t *s)
+{
+    memset(s, 0, sizeof(*s));
+#    ifdef OS_DETECTION_ENABLE
+    s->os = detected_host_os();
+#    endif
+    s->modes.scroll = keyball.scroll_mode;
+    s->modes.ssnap  = keyball_get_scrollsnap_mode();
+    s->modes.sdiv   = keyball.scroll_div;
+#    ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
+    s->modes.amle  = get_auto_mouse_enable();
+    s->aml_timeout = get_auto_mouse_timeout() / 10;
+#    endif
+    s->layer   = (uint8_t)layer_state;
+    s->cpi     = keyball.cpi_value;
+    s->mouse.x = keyball.last_mouse.x;
+    s->mouse.y = keyball.last_mouse.y;
+    s->mouse.h = keyball.last_mouse.h;
+    s->mouse.v = keyball.last_mouse.v;
+}
+#endif
+
+#ifdef SPLIT_KEYBOARD
+// 複製する時の単位になるフィールド。変化したものだけをこの順に送る。
+static const struct {
+    uint8_t offset;
+    uint8_t size;
+} state_fields[] = {
+    {offsetof(keyball_state_t, os), sizeof(((keyball_state_t *)0)->os)},
+    {offsetof(keyball_state_t, modes), sizeof(((keyball_state_t *)0)->modes)},
+    {offsetof(keyball_state_t, layer), sizeof(((keyball_state_t *)0)->layer)},
+    {offsetof(keyball_state_t, cpi), sizeof(((keyball_state_t *)0)->cpi)},
+    {offsetof(keyball_state_t, aml_timeout), sizeof(((keyball_state_t *)0)->aml_timeout)},
+    {offsetof(keyball_state_t, mouse), sizeof(((keyball_state_t *)0)->mouse)},
+};
+
+_Static_assert(sizeof(state_fields) / sizeof(state_fields[0]) <= 8, "state_fields must fit in the 8-bit mask");
+
+// state_encodeはprevからcurrへの差分をbufに書き、その長さを返します。変化がなければ0を返します。
+// fullがtrueなら変化の有無によらず全てのフィールドを書く。
+// 形式: [変化したフィールドのマスク][変化したフィールドの値...]
+static uint8_t state_encode(uint8_t *buf, const keyball_state_t *prev, const keyball_state_t *curr, bool full)
+{
+    uint8_t mask = 0;
+    uint8_t len  = 1;
+    for (uint8_t i = 0; i < sizeof(state_fields) / sizeof(state_fields[0]); i++)
+    {
+        const uint8_t *p = (const uint8_t *)prev + state_fields[i].offset;
+        const uint8_t *c = (const uint8_t *)curr + state_fields[i].offset;
+        if (full || memcmp(p, c, state_fields[i].size) != 0)
+        {
+            mask |= 1 << i;
+            memcpy(buf + len, c, state_fields[i].size);
+            len += state_fields[i].size;
+        }
+    }
+    buf[0] = mask;
+    return mask == 0 ? 0 : len;
+}
+
+// state_decodeはstate_encodeで書かれた差分をsに適用します。
+static void state_decode(keyball_state_t *s, const uint8_t *buf, uint8_t len)
+{
+    if (len < 1)
+    {
+        return;
+    }
+    uint8_t mask = buf[0];
+    uint8_t off  = 1;
+    for (uint8_t i = 0; i < sizeof(state_fields) / sizeof(state_fields[0]); i++)
+    {
+        if ((mask & (1 << i)) == 0)
+        {
+            continue;
+        }
+        if (off + state_fields[i].size > len)
+        {
+            return;
+        }
+        memcpy((uint8_t *)s + state_fields[i].offset, buf + off, state_fields[i].size);
+        off += state_fields[i].size;
+    }
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // スプリットRPC
 
 #ifdef SPLIT_KEYBOARD
 
-static void rpc_get_info_handler(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data)
+// マスターとセカンダリの間のやり取りは、1つのトランザクション(KEYBALL_BATCH)に
+// TLVを並べてまとめて送る。1周期のコマンドが1往復で済み、
+// コマンドを増やしてもトランザクションIDを増やさずに済む。
+//
+// TLVの形式: [種類(1バイト)][長さ(1バイト)][値(長さバイト)]
+// KEYBALL_TLV_ENDかバッファの終わりで終端する。知らない種類は長さの分だけ読み飛ばす。
+
+// tlv_putはbufにTLVを1つ追加します。収まらなければ何もせずfalseを返します。
+static bool tlv_put(uint8_t *buf, uint8_t size, uint8_t *len, uint8_t type, uint8_t vlen, const void *value)
 {
-    keyball_info_t info = {
-        .ballcnt = keyball.this_have_ball ? 1 : 0,
-    };
-    *(keyball_info_t *)out_data = info;
-    keyball_on_adjust_layout(KEYBALL_ADJUST_SECONDARY);
+    if (*len + 2 + vlen > size)
+    {
+        return false;
+    }
+    buf[*len]     = type;
+    buf[*len + 1] = vlen;
+    if (vlen > 0)
+    {
+        memcpy(buf + *len + 2, value, vlen);
+    }
+    *len += 2 + vlen;
+    return true;
+}
+
+// tlv_nextはbufのoffの位置にあるTLVの種類と長さを読み、次のTLVの位置を返します。
+// 終端か、壊れたTLVなら0を返します。値はbuf + off + 2から始まる。
+static uint8_t tlv_next(const uint8_t *buf, uint8_t size, uint8_t off, uint8_t *type, uint8_t *vlen)
+{
+    if (off + 2 > size || buf[off] == KEYBALL_TLV_END || off + 2 + buf[off + 1] > size)
+    {
+        return 0;
+    }
+    *type = buf[off];
+    *vlen = buf[off + 1];
+    return off + 2 + *vlen;
+}
+
+// rpc_motion_putはセカンダリの動きを応答に載せます。
+// 8ビットで要求されたら収まる分だけ送り、残りは次回に回す。
+// 末尾のフラグで、動きがあったか、まだ残っているかをマスターに知らせる。
+static void rpc_motion_put(uint8_t *out, uint8_t size, uint8_t *len, uint8_t width)
+{
+    keyball_motion_t m = keyball.this_motion;
+    uint8_t          v[sizeof(keyball_motion_t) + 1];
+    uint8_t          n;
+    if (width == 1)
+    {
+        keyball_motion8_t m8 = {
+            .x = clip8(m.x),
+            .y = clip8(m.y),
+        };
+        memcpy(v, &m8, sizeof(m8));
+        n   = sizeof(m8);
+        m.x = m8.x;
+        m.y = m8.y;
+    }
+    else
+    {
+        memcpy(v, &m, sizeof(m));
+        n = sizeof(m);
+    }
+    v[n] = 0;
+    if (m.x != 0 || m.y != 0)
+    {
+        v[n] |= KEYBALL_MOTION_FLAG_MOVED;
+    }
+    if (m.x != keyball.this_motion.x || m.y != keyball.this_motion.y)
+    {
+        v[n] |= KEYBALL_MOTION_FLAG_MORE;
+    }
+    if (tlv_put(out, size, len, KEYBALL_TLV_MOTION, n + 1, v))
+    {
+        // 送った分をクリア
+        keyball.this_motion.x -= m.x;
+        keyball.this_motion.y -= m.y;
+    }
+}
+
+static void rpc_batch_handler(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data)
+{
+    // 起動後にまだ交渉していなければ、マスターにリセットされたことを知らせる
+    static bool greeted = false;
+    const uint8_t *in  = in_data;
+    uint8_t       *out = out_data;
+    uint8_t        len = 0;
+    uint8_t        type, vlen;
+    memset(out, KEYBALL_TLV_END, out_buflen);
+    if (!greeted)
+    {
+        keyball_info_t info = {
+            .ballcnt = keyball.this_have_ball ? 1 : 0,
+        };
+        tlv_put(out, out_buflen, &len, KEYBALL_TLV_INFO, sizeof(info), &info);
+    }
+    for (uint8_t off = 0, next; (next = tlv_next(in, in_buflen, off, &type, &vlen)) != 0; off = next)
+    {
+        const uint8_t *v = in + off + 2;
+        switch (type)
+        {
+        case KEYBALL_TLV_INFO:
+            if (greeted)
+            {
+                keyball_info_t info = {
+                    .ballcnt = keyball.this_have_ball ? 1 : 0,
+                };
+                tlv_put(out, out_buflen, &len, KEYBALL_TLV_INFO, sizeof(info), &info);
+            }
+            greeted = true;
+            keyball_on_adjust_layout(KEYBALL_ADJUST_SECONDARY);
+            break;
+        case KEYBALL_TLV_MOTION:
+            if (vlen == 1)
+            {
+                rpc_motion_put(out, out_buflen, &len, v[0]);
+            }
+            break;
+        case KEYBALL_TLV_CPI:
+            if (vlen == sizeof(keyball_cpi_t))
+            {
+                keyball_set_cpi(*(const keyball_cpi_t *)v);
+            }
+            break;
+        case KEYBALL_TLV_ANGLE:
+            if (vlen == sizeof(keyball_angle_t))
+            {
+                memcpy(&keyball.this_angle, v, sizeof(keyball_angle_t));
+                keyball.this_angle_pending = true;
+            }
+            break;
+        case KEYBALL_TLV_STATE:
+            state_decode(&keyball.shared_state, v, vlen);
+            break;
+        case KEYBALL_TLV_LIFT_CAL:
+            if (vlen == 1)
+            {
+                keyball.lift_cal_target = v[0] != 0;
+            }
+            break;
+        case KEYBALL_TLV_SUSPEND:
+            // センサーの操作は割り込みの外のhousekeeping_task_kbで行う
+            if (vlen == 1)
+            {
+                keyball.suspended = v[0] != 0;
+            }
+            break;
+        default:
+            // 新しいファームウェアからの知らないコマンドは無視する
+            break;
+        }
+    }
+}
+
+// 統計を取りながらトランザクションを実行するための状態
+static struct {
+    bool     failed;       // 直前のトランザクションが失敗した
+    uint8_t  fail_streak;  // 続けて失敗した回数
+    uint32_t window_start; // バイト数を数え始めた時刻(ms)
+    uint32_t window_bytes; // window_startから送受信したバイト数
+} link_state = {0};
+
+// link_execはtransaction_rpc_execを実行し、通信の統計を更新します。
+static bool link_exec(int8_t id, uint8_t in_len, const void *in, uint8_t out_len, void *out)
+{
+    keyball_link_stats_t *st = &keyball.link;
+    st->attempts++;
+    if (link_state.failed)
+    {
+        st->retries++;
+    }
+    uint32_t start = keyball_timer_us();
+    bool     ok    = transaction_rpc_exec(id, in_len, in, out_len, out);
+    uint32_t rtt   = keyball_timer_us() - start;
+    uint16_t r     = rtt > UINT16_MAX ? UINT16_MAX : (uint16_t)rtt;
+    link_state.failed = !ok;
+    if (!ok)
+    {
+        st->failures++;
+        if (link_state.fail_streak < UINT8_MAX)
+        {
+            link_state.fail_streak++;
+        }
+        return false;
+    }
+    link_state.fail_streak = 0;
+    if (st->rtt_max == 0)
+    {
+        // 最初の成功
+        st->rtt_min = st->rtt_avg = st->rtt_max = r;
+    }
+    st->rtt_min = r < st->rtt_min ? r : st->rtt_min;
+    st->rtt_max = r > st->rtt_max ? r : st->rtt_max;
+    st->rtt_avg += ((int32_t)r - st->rtt_avg) / 8;
+    link_state.window_bytes += in_len + out_len;
+    return true;
+}
+
+// link_updateは1秒ごとに1秒あたりのバイト数を更新します。
+static void link_update(void)
+{
+    uint32_t now     = timer_read32();
+    uint32_t elapsed = TIMER_DIFF_32(now, link_state.window_start);
+    if (elapsed < 1000)
+    {
+        return;
+    }
+    uint32_t bps = link_state.window_bytes * 1000 / elapsed;
+    keyball.link.bytes_per_sec = bps > UINT16_MAX ? UINT16_MAX : (uint16_t)bps;
+    link_state.window_start    = now;
+    link_state.window_bytes    = 0;
+}
+
+#if KEYBALL_LINK_PRINT_INTERVAL > 0
+// link_printは通信の統計を定期的にコンソールに出力します。
+static void link_print(void)
+{
+    static uint32_t last = 0;
+    uint32_t        now  = timer_read32();
+    if (TIMER_DIFF_32(now, last) < KEYBALL_LINK_PRINT_INTERVAL)
+    {
+        return;
+    }
+    last = now;
+    const keyball_link_stats_t *st = &keyball.link;
+    dprintf("keyball:link: attempts=%lu failures=%lu retries=%lu rtt=%u/%u/%u bps=%u\n", (unsigned long)st->attempts, (unsigned long)st->failures, (unsigned long)st->retries, st->rtt_min, st->rtt_avg, st->rtt_max, st->bytes_per_sec);
+}
+#endif
+
+static struct {
+    bool     negotiated;
+    bool     lost;      // 接続が切れて交渉をやり直している
+    uint16_t interval;  // 交渉を試みる間隔(ms)
+    uint32_t last_sync;
+    int      round;
+} rpc_info = {
+    .interval = KEYBALL_TX_GETINFO_INTERVAL,
+};
+
+// 交渉した後、セカンダリに状態を全て送り直す
+static bool state_resync = false;
+
+// rpc_info_dueはセカンダリとの交渉を試みる時期かを返します。
+static bool rpc_info_due(uint32_t now)
+{
+    if (rpc_info.negotiated || TIMER_DIFF_32(now, rpc_info.last_sync) < rpc_info.interval)
+    {
+        return false;
+    }
+    rpc_info.last_sync = now;
+    rpc_info.round++;
+    return true;
 }
 
-static void rpc_get_info_invoke(void)
+// rpc_info_applyはセカンダリから受け取った情報で交渉を完了させます。
+static void rpc_info_apply(bool ok, const keyball_info_t *recv)
 {
-    static bool negotiated = false;
-    static uint32_t last_sync = 0;
-    static int round = 0;
-    uint32_t now = timer_read32();
-    if (negotiated || TIMER_DIFF_32(now, last_sync) < KEYBALL_TX_GETINFO_INTERVAL)
-    {
-        return;
-    }
-    last_sync = now;
-    round++;
-    keyball_info_t recv = {0};
-    if (!transaction_rpc_exec(KEYBALL_GET_INFO, 0, NULL, sizeof(recv), &recv))
+    if (!ok)
     {
-        if (round < KEYBALL_TX_GETINFO_MAXTRY)
+        if (rpc_info.lost)
         {
-            dprintf("keyball:rpc_get_info_invoke: missed #%d\n", round);
+            // セカンダリが戻るまで間隔を広げながら試し続ける
+            rpc_info.interval = rpc_info.interval >= KEYBALL_TX_RENEGOTIATE_MAX / 2 ? KEYBALL_TX_RENEGOTIATE_MAX : rpc_info.interval * 2;
+            dprintf("keyball:rpc_info_apply: missed #%d, retry in %ums\n", rpc_info.round, rpc_info.interval);
+            return;
+        }
+        if (rpc_info.round < KEYBALL_TX_GETINFO_MAXTRY)
+        {
+            dprintf("keyball:rpc_info_apply: missed #%d\n", rpc_info.round);
             return;
         }
     }
-    negotiated = true;
+    rpc_info.negotiated = true;
+    rpc_info.lost       = false;
+    rpc_info.interval   = KEYBALL_TX_GETINFO_INTERVAL;
     keyball.that_enable = true;
-    keyball.that_have_ball = recv.ballcnt > 0;
-    dprintf("keyball:rpc_get_info_invoke: negotiated #%d %d\n", round, keyball.that_have_ball);
+    keyball.that_have_ball = ok && recv->ballcnt > 0;
+    dprintf("keyball:rpc_info_apply: negotiated #%d %d\n", rpc_info.round, keyball.that_have_ball);
 
     // スプリットキーボードの交渉が完了
 
@@ -490,51 +1585,216 @@ static void rpc_get_info_invoke(void)
 #endif
 
     keyball_on_adjust_layout(KEYBALL_ADJUST_PRIMARY);
+
+    // セカンダリがリセットされていれば設定を失っているので、全て送り直す
+    keyball.cpi_changed        = true;
+    keyball.that_angle_changed = true;
+    keyball.that_suspended     = false;
+    keyball.that_lift_cal      = false;
+    state_resync               = true;
 }
 
-static void rpc_get_motion_handler(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data)
+// rpc_link_lostはセカンダリとの接続が切れたか、セカンダリがリセットされた時に、
+// USBをつなぎ直さなくても交渉をやり直せるようにします。
+static void rpc_link_lost(void)
 {
-    *(keyball_motion_t *)out_data = keyball.this_motion;
-    // 動きをクリア
-    keyball.this_motion.x = 0;
-    keyball.this_motion.y = 0;
+    dprintf("keyball:rpc_link_lost: renegotiating\n");
+    rpc_info.negotiated = false;
+    rpc_info.lost       = true;
+    rpc_info.interval   = KEYBALL_TX_RENEGOTIATE_MIN;
+    rpc_info.last_sync  = timer_read32();
+    rpc_info.round      = 0;
+    link_state.fail_streak = 0;
+    keyball.that_enable       = false;
+    keyball.that_have_ball    = false;
+    keyball.that_motion.x     = 0;
+    keyball.that_motion.y     = 0;
+    keyball.that_motion_width = 1;
+    keyball.that_motion_active = false;
+    keyball_on_adjust_layout(KEYBALL_ADJUST_PENDING);
 }
 
-static void rpc_get_motion_invoke(void)
+// rpc_motion_widthはセカンダリの動きを問い合わせる時の1軸あたりのバイト数を返します。
+// 問い合わせない時は0を返します。
+// セカンダリのボールが止まっている間は、問い合わせの間隔を空ける。
+static uint8_t rpc_motion_width(uint32_t now)
 {
     static uint32_t last_sync = 0;
-    uint32_t now = timer_read32();
-    if (TIMER_DIFF_32(now, last_sync) < KEYBALL_TX_GETMOTION_INTERVAL)
-    {
-        return;
-    }
-    keyball_motion_t recv = {0};
-    if (transaction_rpc_exec(KEYBALL_GET_MOTION, 0, NULL, sizeof(recv), &recv))
+    uint8_t interval = keyball.that_motion_active ? KEYBALL_TX_GETMOTION_INTERVAL : KEYBALL_TX_GETMOTION_IDLE_INTERVAL;
+    if (TIMER_DIFF_32(now, last_sync) < interval)
     {
-        keyball.that_motion.x = add16(keyball.that_motion.x, recv.x);
-        keyball.that_motion.y = add16(keyball.that_motion.y, recv.y);
+        return 0;
     }
     last_sync = now;
-    return;
+    return keyball.that_motion_width;
 }
 
-static void rpc_set_cpi_handler(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data)
+// rpc_batch_invokeはこの周期にセカンダリへ送るコマンドをまとめて1往復で実行します。
+static void rpc_batch_invoke(void)
 {
-    keyball_set_cpi(*(keyball_cpi_t *)in_data);
-}
+    uint32_t now = timer_read32();
+    uint8_t  req[KEYBALL_BATCH_SIZE];
+    uint8_t  len     = 0;
+    // セカンダリは要求がなくてもリセット後はINFOを返すので、常にその分を空けておく
+    uint8_t  respmax = 2 + sizeof(keyball_info_t);
 
-static void rpc_set_cpi_invoke(void)
-{
-    if (!keyball.cpi_changed)
+    bool want_info = rpc_info_due(now);
+    if (want_info)
+    {
+        tlv_put(req, sizeof(req), &len, KEYBALL_TLV_INFO, 0, NULL);
+    }
+    uint8_t width = 0;
+    bool    cpi   = false;
+    bool    angle = false;
+    if (keyball.that_have_ball)
+    {
+        width = rpc_motion_width(now);
+        if (width > 0)
+        {
+            tlv_put(req, sizeof(req), &len, KEYBALL_TLV_MOTION, 1, &width);
+            respmax += 2 + width * 2 + 1;
+        }
+        if (keyball.cpi_changed)
+        {
+            keyball_cpi_t v = keyball.cpi_value;
+            cpi = tlv_put(req, sizeof(req), &len, KEYBALL_TLV_CPI, sizeof(v), &v);
+        }
+        if (keyball.that_angle_changed)
+        {
+            keyball_xform_t xf;
+            keyball_angle_t v = orient_compute(!is_keyboard_left(), &xf);
+            angle = tlv_put(req, sizeof(req), &len, KEYBALL_TLV_ANGLE, sizeof(v), &v);
+        }
+    }
+    bool suspend = false;
+    if (keyball.that_have_ball && keyball.that_suspended != keyball.suspended)
+    {
+        uint8_t v = keyball.suspended;
+        suspend = tlv_put(req, sizeof(req), &len, KEYBALL_TLV_SUSPEND, sizeof(v), &v);
+    }
+    bool lift_cal = false;
+    if (keyball.that_have_ball && keyball.that_lift_cal != keyball.lift_cal_target)
+    {
+        uint8_t v = keyball.lift_cal_target;
+        lift_cal = tlv_put(req, sizeof(req), &len, KEYBALL_TLV_LIFT_CAL, sizeof(v), &v);
+    }
+    // セカンダリのOLED用に、変化した状態だけを間隔を空けて複製する
+    static uint32_t state_sync = 0;
+    keyball_state_t state;
+    bool            state_sent = false;
+    if (keyball.that_enable && TIMER_DIFF_32(now, state_sync) >= KEYBALL_TX_STATE_INTERVAL)
+    {
+        uint8_t delta[1 + sizeof(keyball_state_t)];
+        state_snapshot(&state);
+        uint8_t n = state_encode(delta, &keyball.shared_state, &state, state_resync);
+        if (n > 0)
+        {
+            state_sent = tlv_put(req, sizeof(req), &len, KEYBALL_TLV_STATE, n, delta);
+            state_sync = now;
+        }
+    }
+    if (len == 0)
+    {
+        return;
+    }
+
+    uint8_t resp[KEYBALL_BATCH_SIZE] = {0};
+    bool    ok = link_exec(KEYBALL_BATCH, len, req, respmax, resp);
+
+    bool           got_info = false;
+    keyball_info_t info     = {0};
+    uint8_t        type, vlen;
+    for (uint8_t off = 0, next; ok && (next = tlv_next(resp, respmax, off, &type, &vlen)) != 0; off = next)
+    {
+        const uint8_t *v = resp + off + 2;
+        switch (type)
+        {
+        case KEYBALL_TLV_INFO:
+            if (vlen == sizeof(info))
+            {
+                memcpy(&info, v, sizeof(info));
+                got_info = true;
+            }
+            break;
+        case KEYBALL_TLV_MOTION:
+        {
+            keyball_motion_t recv  = {0};
+            uint8_t          flags = vlen > 0 ? v[vlen - 1] : 0;
+            if (vlen == sizeof(keyball_motion8_t) + 1)
+            {
+                recv.x = ((const keyball_motion8_t *)v)->x;
+                recv.y = ((const keyball_motion8_t *)v)->y;
+                // 8ビットに収まらずセカンダリに残りがあるので、次は16ビットで受け取る
+                if (flags & KEYBALL_MOTION_FLAG_MORE)
+                {
+                    keyball.that_motion_width = 2;
+                }
+            }
+            else if (vlen == sizeof(keyball_motion_t) + 1)
+            {
+                memcpy(&recv, v, sizeof(recv));
+                // 8ビットに収まるようになったら2バイトに戻す
+                if (recv.x == clip8(recv.x) && recv.y == clip8(recv.y))
+                {
+                    keyball.that_motion_width = 1;
+                }
+            }
+            else
+            {
+                flags = 0;
+            }
+            // 動きがなければ、次の問い合わせはKEYBALL_TX_GETMOTION_IDLE_INTERVAL後にする
+            keyball.that_motion_active = flags != 0;
+            keyball.that_motion.x = add16(keyball.that_motion.x, recv.x);
+            keyball.that_motion.y = add16(keyball.that_motion.y, recv.y);
+            if (recv.x != 0 || recv.y != 0)
+            {
+                // セカンダリのフレームの時刻は分からないので受信時刻で代用する
+                keyball.frame_us[!is_keyboard_left()] = keyball_timer_us();
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    if (want_info)
+    {
+        rpc_info_apply(got_info, &info);
+    }
+    else if (got_info)
     {
+        // 頼んでいないINFOが返ってきたら、セカンダリがリセットされている
+        rpc_link_lost();
         return;
     }
-    keyball_cpi_t req = keyball.cpi_value;
-    if (!transaction_rpc_send(KEYBALL_SET_CPI, sizeof(req), &req))
+    else if (rpc_info.negotiated && link_state.fail_streak >= KEYBALL_TX_LINK_LOSS_FAILURES)
     {
+        rpc_link_lost();
         return;
     }
-    keyball.cpi_changed = false;
+    if (ok && cpi)
+    {
+        keyball.cpi_changed = false;
+    }
+    if (ok && angle)
+    {
+        keyball.that_angle_changed = false;
+    }
+    if (ok && state_sent)
+    {
+        keyball.shared_state = state;
+        state_resync         = false;
+    }
+    if (ok && suspend)
+    {
+        keyball.that_suspended = keyball.suspended;
+    }
+    if (ok && lift_cal)
+    {
+        keyball.that_lift_cal = keyball.lift_cal_target;
+    }
 }
 
 #endif
@@ -601,9 +1861,28 @@ const char PROGMEM code_to_name[] = {
 };
 #endif
 
+#ifdef OLED_ENABLE
+// oled_stateはOLEDに表示する状態を返します。
+// セカンダリはUSBにつながっていないので、マスターから複製された状態を使う。
+static void oled_state(keyball_state_t *s)
+{
+#    ifdef SPLIT_KEYBOARD
+    if (!is_keyboard_master())
+    {
+        *s = keyball.shared_state;
+        return;
+    }
+#    endif
+    state_snapshot(s);
+}
+#endif
+
 void keyball_oled_render_ballinfo(void)
 {
 #ifdef OLED_ENABLE
+    keyball_state_t st;
+    oled_state(&st);
+
     // フォーマット: `Ball:{mouse x}{mouse y}{mouse h}{mouse v}`
     //
     // 出力例:
@@ -612,19 +1891,19 @@ void keyball_oled_render_ballinfo(void)
 
     // 1行目: "Ball"ラベル、マウスx, y, h, v
     oled_write_P(PSTR("Ball\xB1"), false);
-    oled_write(format_4d(keyball.last_mouse.x), false);
-    oled_write(format_4d(keyball.last_mouse.y), false);
-    oled_write(format_4d(keyball.last_mouse.h), false);
-    oled_write(format_4d(keyball.last_mouse.v), false);
+    oled_write(format_4d(st.mouse.x), false);
+    oled_write(format_4d(st.mouse.y), false);
+    oled_write(format_4d(st.mouse.h), false);
+    oled_write(format_4d(st.mouse.v), false);
 
     // 2行目: 空白ラベルとCPI
     oled_write_P(PSTR("    \xB1\xBC\xBD"), false);
-    oled_write(format_4d(keyball_get_cpi()) + 1, false);
+    oled_write(format_4d(st.cpi == 0 ? CPI_DEFAULT : st.cpi) + 1, false);
     oled_write_P(PSTR("00 "), false);
 
-    // スクロールスナップモードを表示: "VT" (垂直), "HO" (水平), "SCR" (自由)
+    // スクロールスナップモードを表示: "VT" (垂直), "HO" (水平), "AU" (自動), "SCR" (自由)
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
-    switch (keyball_get_scrollsnap_mode())
+    switch (st.modes.ssnap)
     {
     case KEYBALL_SCROLLSNAP_MODE_VERTICAL:
         oled_write_P(PSTR("VT"), false);
@@ -632,6 +1911,9 @@ void keyball_oled_render_ballinfo(void)
     case KEYBALL_SCROLLSNAP_MODE_HORIZONTAL:
         oled_write_P(PSTR("HO"), false);
         break;
+    case KEYBALL_SCROLLSNAP_MODE_AUTO:
+        oled_write_P(PSTR("AU"), false);
+        break;
     default:
         oled_write_P(PSTR("\xBE\xBF"), false);
         break;
@@ -640,7 +1922,7 @@ void keyball_oled_render_ballinfo(void)
     oled_write_P(PSTR("\xBE\xBF"), false);
 #endif
     // スクロールモードの表示: ON/OFF
-    if (keyball.scroll_mode)
+    if (st.modes.scroll)
     {
         oled_write_P(LFSTR_ON, false);
     }
@@ -651,14 +1933,45 @@ void keyball_oled_render_ballinfo(void)
 
     // スクロール除数の表示:
     oled_write_P(PSTR(" \xC0\xC1"), false);
-    oled_write_char('0' + keyball_get_scroll_div(), false);
+    oled_write_char(to_1x(st.modes.sdiv == 0 ? KEYBALL_SCROLL_DIV_DEFAULT : st.modes.sdiv), false);
 #endif
 }
 
 void keyball_oled_render_ballsubinfo(void)
 {
 #ifdef OLED_ENABLE
-    // 追加のボール情報が必要な場合に実装
+    // フォーマット: `Surf:{squal} Sh{shutter} D{drop %}`
+    //
+    // 出力例:
+    //
+    //     Surf:  42 Sh 189 D  3
+
+    const keyball_surface_t *s = &keyball.this_surface;
+    oled_write_P(PSTR("Surf\xB1"), false);
+    oled_write(format_4d(s->squal / 16), false);
+    oled_write_P(PSTR(" Sh"), false);
+    oled_write(format_4d(s->shutter > 9999 ? 9999 : s->shutter), false);
+    oled_write_P(PSTR(" D"), false);
+    oled_write(format_4d(s->frames == 0 ? 0 : (uint32_t)s->gated * 100 / s->frames) + 1, false);
+#endif
+}
+
+void keyball_oled_render_linkinfo(void)
+{
+#ifdef OLED_ENABLE
+    // フォーマット: `Link:{fail %} R{rtt avg us} B{bytes/s}`
+    //
+    // 出力例:
+    //
+    //     Link:   0 R 412 B 156
+
+    const keyball_link_stats_t *st = &keyball.link;
+    oled_write_P(PSTR("Link\xB1"), false);
+    oled_write(format_4d(st->attempts == 0 ? 0 : st->failures * 100 / st->attempts), false);
+    oled_write_P(PSTR(" R"), false);
+    oled_write(format_4d(st->rtt_avg > 9999 ? 9999 : st->rtt_avg), false);
+    oled_write_P(PSTR(" B"), false);
+    oled_write(format_4d(st->bytes_per_sec > 9999 ? 9999 : st->bytes_per_sec), false);
 #endif
 }
 
@@ -704,16 +2017,19 @@ void keyball_oled_render_layerinfo(void)
     //
     //     Layer:-23------------
 
+    keyball_state_t st;
+    oled_state(&st);
+
     oled_write_P(PSTR("L\xB6\xB7r\xB1"), false);
     for (uint8_t i = 1; i < 8; i++)
     {
-        oled_write_char((layer_state_is(i) ? to_1x(i) : BL), false);
+        oled_write_char(((st.layer & (1 << i)) ? to_1x(i) : BL), false);
     }
     oled_write_char(' ', false);
 
 #ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
     oled_write_P(PSTR("\xC2\xC3"), false);
-    if (get_auto_mouse_enable())
+    if (st.modes.amle)
     {
         oled_write_P(LFSTR_ON, false);
     }
@@ -722,7 +2038,7 @@ void keyball_oled_render_layerinfo(void)
         oled_write_P(LFSTR_OFF, false);
     }
 
-    oled_write(format_4d(get_auto_mouse_timeout() / 10) + 1, false);
+    oled_write(format_4d(st.aml_timeout) + 1, false);
     oled_write_char('0', false);
 #else
     oled_write_P(PSTR("\xC2\xC3\xB4\xB5 ---"), false);
@@ -734,8 +2050,10 @@ void keyball_oled_render_layerinfo(void)
 #ifdef OLED_ENABLE
 void keyball_oled_render_osinfo(void) {
 #ifdef OS_DETECTION_ENABLE
+    keyball_state_t st;
+    oled_state(&st);
     char os_str[9];
-    switch (detected_host_os()) {
+    switch (st.os) {
         case OS_WINDOWS:
             strcpy(os_str, "Win");
             break;
@@ -759,20 +2077,106 @@ void keyball_oled_render_osinfo(void) {
 ////////////////////////////////////////////////////////////////////////////////
 // 公開API関数
 
+uint32_t keyball_timer_us(void)
+{
+#if defined(__AVR__)
+    // ミリ秒タイマー(timer0)のハードウェアカウンターで1ms未満を補う
+    return pmw3360_timer_us();
+#elif defined(PROTOCOL_CHIBIOS)
+    return TIME_I2US(chVTGetSystemTimeX());
+#else
+    // ホスト上でのテスト用。テストがtimer_read32()で時刻を進める
+    return timer_read32() * 1000;
+#endif
+}
+
 bool keyball_get_scroll_mode(void)
 {
     return keyball.scroll_mode;
 }
 
+// carry_addはカウントの16倍の量tをノッチと端数に分けて、スクロールの持ち越しに足します。
+static void carry_add(int16_t *rem, int16_t *excess, int32_t t, uint16_t div)
+{
+    t += *rem;
+    int32_t u = t / div;
+    *rem = t - u * div;
+    *excess = clip16(*excess + u);
+}
+
+// carry_to_scrollはボールiのポインター移動の持ち越しを、スクロールの持ち越しに読み替えます。
+// ポインターの1単位をボールの1カウントとみなす。
+static void carry_to_scroll(uint8_t i)
+{
+    keyball_carry_t *mc = &keyball.move_carry[i];
+    keyball_carry_t *sc = &keyball.scroll_carry[i];
+    uint16_t div_h = pgm_read_word(&scroll_div_q4[keyball_get_scroll_div_h() - 1]);
+    uint16_t div_v = pgm_read_word(&scroll_div_q4[keyball_get_scroll_div() - 1]);
+    int16_t h, v, rh, rv;
+    apply_xform(&keyball.xform[i], mc->excess.x, mc->excess.y, &h, &v);
+    apply_xform(&keyball.xform[i], mc->rem.x, mc->rem.y, &rh, &rv);
+    // スクロールの端数はカウントの16倍、ポインターの端数は1/256単位
+    carry_add(&sc->rem.x, &sc->excess.x, (int32_t)h * 16 + rh / 16, div_h);
+    carry_add(&sc->rem.y, &sc->excess.y, -((int32_t)v * 16 + rv / 16), div_v);
+    memset(mc, 0, sizeof(*mc));
+}
+
+// carry_to_moveはボールiのスクロールの持ち越しを、ポインター移動の持ち越しに読み替えます。
+static void carry_to_move(uint8_t i)
+{
+    keyball_carry_t *mc = &keyball.move_carry[i];
+    keyball_carry_t *sc = &keyball.scroll_carry[i];
+    uint16_t div_h = pgm_read_word(&scroll_div_q4[keyball_get_scroll_div_h() - 1]);
+    uint16_t div_v = pgm_read_word(&scroll_div_q4[keyball_get_scroll_div() - 1]);
+    // ノッチを除数でカウントの16倍に戻して端数と合わせ、画面上の向き(下が正)にする
+    int32_t th = (int32_t)sc->excess.x * div_h + sc->rem.x;
+    int32_t tv = -((int32_t)sc->excess.y * div_v + sc->rem.y);
+    int16_t mx, my, rx, ry;
+    unapply_xform(&keyball.xform[i], clip16(th / 16), clip16(tv / 16), &mx, &my);
+    unapply_xform(&keyball.xform[i], (th % 16) * 16, (tv % 16) * 16, &rx, &ry);
+    mc->excess.x = add16(mc->excess.x, mx);
+    mc->excess.y = add16(mc->excess.y, my);
+    mc->rem.x += rx;
+    mc->rem.y += ry;
+    memset(sc, 0, sizeof(*sc));
+}
+
 void keyball_set_scroll_mode(bool mode)
 {
     if (mode != keyball.scroll_mode)
     {
-        keyball.scroll_mode_changed = timer_read32();
+        keyball.motion_mode_changed = timer_read32();
+        keyball.motion_mode = mode ? KEYBALL_MOTION_MODE_TO_SCROLL : KEYBALL_MOTION_MODE_TO_POINTER;
+        // 持ち越した量は捨てずに、切替後のモードの単位に読み替える。
+        // セカンダリのボールは、プライマリにボールがあれば逆のモードになる。
+        for (uint8_t i = 0; i < 2; i++)
+        {
+            bool was_scroll = keyball.scroll_mode ^ (i != is_keyboard_left() && keyball.this_have_ball);
+            if (was_scroll)
+            {
+                carry_to_move(i);
+            }
+            else
+            {
+                carry_to_scroll(i);
+            }
+        }
+#if KEYBALL_KINETIC_SCROLL_ENABLE
+        memset(keyball.kinetic, 0, sizeof(keyball.kinetic));
+#endif
+#if KEYBALL_SCROLLSNAP_ENABLE == 2
+        snap_auto_reset(&keyball.scrollsnap_auto[0]);
+        snap_auto_reset(&keyball.scrollsnap_auto[1]);
+#endif
     }
     keyball.scroll_mode = mode;
 }
 
+keyball_motion_mode_t keyball_get_motion_mode(void)
+{
+    return keyball.motion_mode;
+}
+
 keyball_scrollsnap_mode_t keyball_get_scrollsnap_mode(void)
 {
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
@@ -786,6 +2190,8 @@ void keyball_set_scrollsnap_mode(keyball_scrollsnap_mode_t mode)
 {
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
     keyball.scrollsnap_mode = mode;
+    snap_auto_reset(&keyball.scrollsnap_auto[0]);
+    snap_auto_reset(&keyball.scrollsnap_auto[1]);
 #endif
 }
 
@@ -799,6 +2205,16 @@ void keyball_set_scroll_div(uint8_t div)
     keyball.scroll_div = div > SCROLL_DIV_MAX ? SCROLL_DIV_MAX : div;
 }
 
+uint8_t keyball_get_scroll_div_h(void)
+{
+    return keyball.scroll_div_h == 0 ? keyball_get_scroll_div() : keyball.scroll_div_h;
+}
+
+void keyball_set_scroll_div_h(uint8_t div)
+{
+    keyball.scroll_div_h = div > SCROLL_DIV_MAX ? SCROLL_DIV_MAX : div;
+}
+
 uint8_t keyball_get_cpi(void)
 {
     return keyball.cpi_value == 0 ? CPI_DEFAULT : keyball.cpi_value;
@@ -812,10 +2228,106 @@ void keyball_set_cpi(uint8_t cpi)
     }
     keyball.cpi_value = cpi;
     keyball.cpi_changed = true;
-    if (keyball.this_have_ball)
+    // セカンダリではトランザクションハンドラー(割り込み)から呼ばれるので、
+    // センサーへの反映はsensor_updateに任せる
+    keyball.this_cpi_pending = true;
+}
+
+uint8_t keyball_get_accel_profile(void)
+{
+    return keyball.accel_profile == 0 ? KEYBALL_ACCEL_PROFILE_DEFAULT : keyball.accel_profile - 1;
+}
+
+keyball_report_rate_t keyball_get_report_rate(void)
+{
+    return keyball.report_rate == 0 ? KEYBALL_REPORT_RATE_DEFAULT : keyball.report_rate - 1;
+}
+
+void keyball_set_report_rate(keyball_report_rate_t rate)
+{
+    if (rate > KEYBALL_REPORT_RATE_1000HZ)
+    {
+        rate = KEYBALL_REPORT_RATE_1000HZ;
+    }
+    keyball.report_rate = rate + 1;
+}
+
+void keyball_set_accel_profile(uint8_t profile)
+{
+    if (profile >= ACCEL_PROFILE_COUNT)
+    {
+        profile = ACCEL_PROFILE_COUNT - 1;
+    }
+    keyball.accel_profile = profile + 1;
+}
+
+keyball_link_stats_t keyball_get_link_stats(void)
+{
+    return keyball.link;
+}
+
+bool keyball_get_rest_mode(void)
+{
+    return keyball.rest_mode;
+}
+
+void keyball_set_rest_mode(bool enable)
+{
+    keyball.rest_mode = enable;
+    keyball.this_rest_pending = true;
+}
+
+keyball_orient_t keyball_get_orientation(bool is_left)
+{
+    return keyball.orient[is_left];
+}
+
+void keyball_set_orientation(bool is_left, keyball_orient_t orient)
+{
+    keyball.orient[is_left] = orient;
+    orient_update();
+}
+
+// リフトカットオフの較正結果を受け取り、適用する。
+// pmw3360_taskの中から呼ばれるので、EEPROMへの保存はlift_cutoff_saveに任せる。
+static void lift_cal_on_result(uint8_t addr, uint8_t data)
+{
+    keyball.lift_cutoff = data;
+    keyball.lift_cutoff_dirty = true;
+    if (!pmw3360_lift_cutoff_set(data))
+    {
+        dprintf("keyball:lift_cal_on_result: queue full, cutoff not applied\n");
+    }
+    dprintf("keyball:lift_cal_on_result: cutoff=%d\n", data);
+}
+
+// lift_cutoff_saveは較正したリフトカットオフをEEPROMに保存します。
+static void lift_cutoff_save(void)
+{
+    if (!keyball.lift_cutoff_dirty)
+    {
+        return;
+    }
+    keyball.lift_cutoff_dirty = false;
+    keyball_config_t c = {.raw = eeconfig_read_kb()};
+    c.lcut = keyball.lift_cutoff;
+    eeconfig_update_kb(c.raw);
+}
+
+bool keyball_get_lift_calibrating(void)
+{
+    return keyball.lift_cal_target;
+}
+
+void keyball_set_lift_calibrating(bool start)
+{
+    if (start && !keyball.this_have_ball && !keyball.that_have_ball)
     {
-        pmw3360_cpi_set(cpi == 0 ? CPI_DEFAULT - 1 : cpi - 1);
+        dprintf("keyball:lift_cal: no ball to calibrate\n");
+        return;
     }
+    // センサーへの反映はsensor_updateで、セカンダリへはバッチ転送で行う
+    keyball.lift_cal_target = start;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -827,9 +2339,7 @@ void keyboard_post_init_kb(void)
     // セカンダリでトランザクションハンドラーを登録
     if (!is_keyboard_master())
     {
-        transaction_register_rpc(KEYBALL_GET_INFO, rpc_get_info_handler);
-        transaction_register_rpc(KEYBALL_GET_MOTION, rpc_get_motion_handler);
-        transaction_register_rpc(KEYBALL_SET_CPI, rpc_set_cpi_handler);
+        transaction_register_rpc(KEYBALL_BATCH, rpc_batch_handler);
     }
 #endif
 
@@ -838,35 +2348,185 @@ void keyboard_post_init_kb(void)
     {
         keyball_config_t c = {.raw = eeconfig_read_kb()};
         keyball_set_cpi(c.cpi);
-        keyball_set_scroll_div(c.sdiv);
+        // 以前の2の乗数の段階を半オクターブ刻みの段階に読み替える
+        keyball_set_scroll_div(c.sdiv == 0 ? 0 : c.sdiv * 2 - 1);
 #ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
         set_auto_mouse_enable(c.amle);
         set_auto_mouse_timeout(c.amlto == 0 ? AUTO_MOUSE_TIME : (c.amlto + 1) * AML_TIMEOUT_QU);
 #endif
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
         keyball_set_scrollsnap_mode(c.ssnap);
+#endif
+        keyball.lift_cutoff = c.lcut;
+#if (EECONFIG_KB_DATA_SIZE) > 0
+        keyball_datablock_t db;
+        eeconfig_read_kb_datablock(&db);
+        memcpy(keyball.orient, db.orient, sizeof(keyball.orient));
+        keyball.accel_profile = db.accel;
+        keyball.report_rate = db.rate;
+        keyball.scroll_div_h = db.sdiv_h;
+        if (db.sdiv != 0)
+        {
+            keyball_set_scroll_div(db.sdiv);
+        }
 #endif
     }
+    // 左右が確定したので、ボールの向きから軸の変換を計算する
+    orient_update();
 
     keyball_on_adjust_layout(KEYBALL_ADJUST_PENDING);
     keyboard_post_init_user();
 }
 
-#if SPLIT_KEYBOARD
-void housekeeping_task_kb(void)
+#if KEYBALL_SURFACE_PRINT_INTERVAL > 0
+// surface_printは表面の状態の統計を定期的にコンソールに出力します。
+static void surface_print(void)
 {
-    if (is_keyboard_master())
+    static uint32_t last = 0;
+    uint32_t now = timer_read32();
+    if (!keyball.this_have_ball || TIMER_DIFF_32(now, last) < KEYBALL_SURFACE_PRINT_INTERVAL)
+    {
+        return;
+    }
+    last = now;
+    const keyball_surface_t *s = &keyball.this_surface;
+    dprintf("keyball:surface: squal=%u shutter=%u frames=%u gated=%u\n", s->squal / 16, s->shutter, s->frames, s->gated);
+}
+#endif
+
+// sensor_updateは保留中のCPIと角度とレストモードをセンサーのキューに追加します。
+// pmw3360のキューは割り込みから操作できないため、メインループでだけ呼ぶ。
+// キューに空きがなければ保留したままにして、次の呼び出しで再試行する。
+static void sensor_update(void)
+{
+    if (!keyball.this_have_ball)
+    {
+        return;
+    }
+    // 反映中に割り込みで再び変更されても取りこぼさないよう、先にクリアする
+    if (keyball.this_cpi_pending)
+    {
+        keyball.this_cpi_pending = false;
+        uint8_t cpi = keyball.cpi_value;
+        if (!pmw3360_cpi_set(cpi == 0 ? CPI_DEFAULT - 1 : cpi - 1))
+        {
+            keyball.this_cpi_pending = true;
+        }
+    }
+    if (keyball.this_angle_pending)
+    {
+        keyball.this_angle_pending = false;
+        if (!pmw3360_angle_set(keyball.this_angle.tune, keyball.this_angle.snap))
+        {
+            keyball.this_angle_pending = true;
+        }
+    }
+    if (keyball.this_rest_pending)
+    {
+        const pmw3360_rest_t rest = {
+            .run_downshift = KEYBALL_PMW3360_RUN_DOWNSHIFT,
+            .rest1_rate = KEYBALL_PMW3360_REST1_RATE,
+            .rest1_downshift = KEYBALL_PMW3360_REST1_DOWNSHIFT,
+            .rest2_rate = KEYBALL_PMW3360_REST2_RATE,
+            .rest2_downshift = KEYBALL_PMW3360_REST2_DOWNSHIFT,
+            .rest3_rate = KEYBALL_PMW3360_REST3_RATE,
+        };
+        // 全ての書き込みを追加できた時だけ完了とする
+        keyball.this_rest_pending = !pmw3360_rest_set(keyball.rest_mode, &rest);
+    }
+    if (keyball.lift_cal_target != keyball.lift_calibrating)
+    {
+        bool start = keyball.lift_cal_target;
+        if (start ? pmw3360_lift_cal_start() : pmw3360_lift_cal_stop(lift_cal_on_result))
+        {
+            keyball.lift_calibrating = start;
+        }
+    }
+}
+
+#if KEYBALL_PMW3360_SHUTDOWN_ON_SUSPEND
+// sensor_suspendはセンサーをシャットダウンするか、シャットダウンから復帰させます。
+// マスターはUSBのサスペンドで、セカンダリはマスターから複製された状態で呼ぶ。
+static void sensor_suspend(bool suspend)
+{
+    static bool shutdown = false;
+    if (suspend == shutdown || (suspend && !keyball.this_have_ball))
+    {
+        return;
+    }
+    shutdown = suspend;
+    if (suspend)
     {
-        rpc_get_info_invoke();
-        if (keyball.that_have_ball)
+        // キューに残っている操作(アップロード中のSROMも)は捨てて、シャットダウンだけを完了させる
+        pmw3360_shutdown();
+        while (pmw3360_async_busy())
         {
-            rpc_get_motion_invoke();
-            rpc_set_cpi_invoke();
+            pmw3360_task();
         }
+        // 較正中の値はシャットダウンで失われる
+        keyball.lift_calibrating = false;
+        keyball.lift_cal_target  = false;
+    }
+    else
+    {
+        // シャットダウンで設定とSROMが失われるので、リセットから初期化し直す
+        pmw3360_init_async(pmw3360_on_init);
     }
 }
 #endif
 
+void housekeeping_task_kb(void)
+{
+    // センサーへの非同期レジスタ操作を進める
+    sensor_update();
+    pmw3360_task();
+    lift_cutoff_save();
+#if KEYBALL_SURFACE_PRINT_INTERVAL > 0
+    surface_print();
+#endif
+#ifdef SPLIT_KEYBOARD
+    if (is_keyboard_master())
+    {
+        rpc_batch_invoke();
+        link_update();
+#if KEYBALL_LINK_PRINT_INTERVAL > 0
+        link_print();
+#endif
+    }
+#if KEYBALL_PMW3360_SHUTDOWN_ON_SUSPEND
+    else
+    {
+        sensor_suspend(keyball.suspended);
+    }
+#endif
+#endif
+}
+
+#if KEYBALL_PMW3360_SHUTDOWN_ON_SUSPEND
+void suspend_power_down_kb(void)
+{
+    // サスペンド中は繰り返し呼ばれるが、シャットダウンは一度だけ行われる
+    keyball.suspended = true;
+    sensor_suspend(true);
+#ifdef SPLIT_KEYBOARD
+    // サスペンド中はhousekeeping_task_kbが呼ばれないので、届くまでここでセカンダリに送る
+    if (keyball.that_suspended != keyball.suspended)
+    {
+        rpc_batch_invoke();
+    }
+#endif
+    suspend_power_down_user();
+}
+
+void suspend_wakeup_init_kb(void)
+{
+    // セカンダリへの復帰はhousekeeping_task_kbのバッチで送る
+    keyball.suspended = false;
+    sensor_suspend(false);
+    suspend_wakeup_init_user();
+}
+#endif
+
 // 押下中のキーを更新する関数
 static void pressing_keys_update(uint16_t keycode, keyrecord_t *record)
 {
@@ -899,6 +2559,7 @@ bool is_mouse_record_kb(uint16_t keycode, keyrecord_t *record)
     switch (keycode)
     {
     case SCRL_MO:
+    case SCRL_TO:
         return true;
     }
     return is_mouse_record_user(keycode, record);
@@ -907,6 +2568,9 @@ bool is_mouse_record_kb(uint16_t keycode, keyrecord_t *record)
 
 bool process_record_kb(uint16_t keycode, keyrecord_t *record)
 {
+    // キーの状態が変化した時刻を記録
+    keyball.key_us = keyball_timer_us();
+
     // OLED用に最後のキーコード、行、列を保存
     keyball.last_kc = keycode;
     keyball.last_pos = record->event.key;
@@ -951,6 +2615,9 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record)
         case KBC_RST:
             keyball_set_cpi(0);
             keyball_set_scroll_div(0);
+            keyball_set_scroll_div_h(0);
+            keyball.accel_profile = 0;
+            keyball.report_rate = 0;
 #ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
             set_auto_mouse_enable(false);
             set_auto_mouse_timeout(AUTO_MOUSE_TIME);
@@ -960,7 +2627,8 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record)
         {
             keyball_config_t c = {
                 .cpi = keyball.cpi_value,
-                .sdiv = keyball.scroll_div,
+                // 古いファームウェアでも読めるよう、近い2の乗数の段階も残す
+                .sdiv = (keyball.scroll_div + 1) / 2,
 #ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
                 .amle = get_auto_mouse_enable(),
                 .amlto = (get_auto_mouse_timeout() / AML_TIMEOUT_QU) - 1,
@@ -968,8 +2636,18 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record)
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
                 .ssnap = keyball_get_scrollsnap_mode(),
 #endif
+                .lcut = keyball.lift_cutoff,
             };
             eeconfig_update_kb(c.raw);
+#if (EECONFIG_KB_DATA_SIZE) > 0
+            keyball_datablock_t db = {0};
+            memcpy(db.orient, keyball.orient, sizeof(db.orient));
+            db.accel = keyball.accel_profile;
+            db.rate = keyball.report_rate;
+            db.sdiv_h = keyball.scroll_div_h;
+            db.sdiv = keyball.scroll_div;
+            eeconfig_update_kb_datablock(&db);
+#endif
         }
         break;
 
@@ -989,6 +2667,15 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record)
         case SCRL_TO:
             keyball_set_scroll_mode(!keyball.scroll_mode);
             break;
+        case ACC_NEXT:
+            keyball_set_accel_profile((keyball_get_accel_profile() + 1) % ACCEL_PROFILE_COUNT);
+            break;
+        case RPT_NEXT:
+            keyball_set_report_rate((keyball_get_report_rate() + 1) % (KEYBALL_REPORT_RATE_1000HZ + 1));
+            break;
+        case KBC_LCAL:
+            keyball_set_lift_calibrating(!keyball_get_lift_calibrating());
+            break;
         case SCRL_DVI:
             add_scroll_div(1);
             break;
@@ -1006,6 +2693,9 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record)
         case SSNP_FRE:
             keyball_set_scrollsnap_mode(KEYBALL_SCROLLSNAP_MODE_FREE);
             break;
+        case SSNP_AUT:
+            keyball_set_scrollsnap_mode(KEYBALL_SCROLLSNAP_MODE_AUTO);
+            break;
 #endif
 
 #ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
@@ -21,15 +21,102 @@ Copyright 2022 MURAOKA Taro (aka KoRoN)
 #endif
 
 #ifndef KEYBALL_SCROLL_DIV_DEFAULT
-#    define KEYBALL_SCROLL_DIV_DEFAULT 4 // スクロール除数のデフォルト値 (4: 1/8)
+#    define KEYBALL_SCROLL_DIV_DEFAULT 7 // スクロール除数の段階のデフォルト値 (7: 1/8)
 #endif
 
-#ifndef KEYBALL_REPORTMOUSE_INTERVAL
-#    define KEYBALL_REPORTMOUSE_INTERVAL 8 // マウスレポート間隔: 125Hz
+/// 慣性スクロールを使う場合、config.hに1を定義
+#ifndef KEYBALL_KINETIC_SCROLL_ENABLE
+#    define KEYBALL_KINETIC_SCROLL_ENABLE 0
+#endif
+#ifndef KEYBALL_KINETIC_MIN_SPEED
+#    define KEYBALL_KINETIC_MIN_SPEED 20 // 慣性スクロールを始める最低速度 (ノッチ/秒)
+#endif
+#ifndef KEYBALL_KINETIC_STOP_SPEED
+#    define KEYBALL_KINETIC_STOP_SPEED 2 // 慣性スクロールを止める速度 (ノッチ/秒)
+#endif
+#ifndef KEYBALL_KINETIC_FRICTION
+#    define KEYBALL_KINETIC_FRICTION 4 // 摩擦: 1msあたりの減速率 (1/1024単位)
+#endif
+#ifndef KEYBALL_KINETIC_RELEASE_TIMEOUT
+#    define KEYBALL_KINETIC_RELEASE_TIMEOUT 20 // ボールが離されたとみなす時間(ms)
+#endif
+
+#ifndef KEYBALL_REPORT_RATE_DEFAULT
+#    define KEYBALL_REPORT_RATE_DEFAULT KEYBALL_REPORT_RATE_125HZ // 操作中のマウスレポートレート
+#endif
+
+#ifndef KEYBALL_REPORT_IDLE_TIMEOUT
+#    define KEYBALL_REPORT_IDLE_TIMEOUT 500 // この時間(ms)動きがなければ、次の動きは間隔を待たずに送る
 #endif
 
 #ifndef KEYBALL_SCROLLBALL_INHIVITOR
-#    define KEYBALL_SCROLLBALL_INHIVITOR 50 // スクロールモード切替後の無視時間(ms)
+#    define KEYBALL_SCROLLBALL_INHIVITOR 50 // スクロールモード切替後の保留時間(ms)
+#endif
+
+/// ポインターからスクロールへの切替後、動きを保留する時間(ms)
+#ifndef KEYBALL_TRANSITION_TO_SCROLL
+#    define KEYBALL_TRANSITION_TO_SCROLL KEYBALL_SCROLLBALL_INHIVITOR
+#endif
+
+/// スクロールからポインターへの切替後、動きを保留する時間(ms)
+#ifndef KEYBALL_TRANSITION_TO_POINTER
+#    define KEYBALL_TRANSITION_TO_POINTER KEYBALL_SCROLLBALL_INHIVITOR
+#endif
+
+/// マウス加速度のプロファイル。KEYBALL_ACCEL_PROFILE(low, threshold, slope, cap)を並べる。
+/// 速度は500CPIで8msあたりのカウント数で表し、レポートレートやCPIによらない。
+///   low:       速度0のときのゲイン (Q8.8: 256で1.0倍)
+///   threshold: ゲインが1.0倍になる速度。これ未満では減速する
+///   slope:     thresholdを超えた速度1あたりのゲインの増分 (Q8.8)
+///   cap:       ゲインの上限 (Q8.8)
+#ifndef KEYBALL_ACCEL_PROFILES
+#    define KEYBALL_ACCEL_PROFILES \
+        KEYBALL_ACCEL_PROFILE(256, 0, 0, 256),   /* 0: 加速なし */ \
+        KEYBALL_ACCEL_PROFILE(26, 5, 10, 768),   /* 1: 標準 */ \
+        KEYBALL_ACCEL_PROFILE(26, 5, 20, 1024),  /* 2: 強め */
+#endif
+
+#ifndef KEYBALL_ACCEL_PROFILE_DEFAULT
+#    define KEYBALL_ACCEL_PROFILE_DEFAULT 1 // デフォルトの加速度プロファイル
+#endif
+
+// モーションフィルター: センサーのノイズやゴミによる誤動作を抑える。
+// 中央値フィルター → 速度適応ローパス → デッドゾーンの順に、フレームごとに適用する。
+// 捨てるのは突発的な値だけで、遅らせた動きは止まった時に送りきる。
+#ifndef KEYBALL_FILTER_MEDIAN
+#    define KEYBALL_FILTER_MEDIAN 1 // 直近3フレームの中央値で突発的な値を除く (0で無効)
+#endif
+#ifndef KEYBALL_FILTER_SPIKE
+#    define KEYBALL_FILTER_SPIKE 64 // 中央値との差がこれを超えるフレームの値を突発的とみなして捨てる
+#endif
+#ifndef KEYBALL_FILTER_LOWPASS_MIN
+#    define KEYBALL_FILTER_LOWPASS_MIN 96 // 静止に近い速度でのローパスの係数 (256で無効)
+#endif
+#ifndef KEYBALL_FILTER_LOWPASS_BETA
+#    define KEYBALL_FILTER_LOWPASS_BETA 32 // フレームの移動量1あたりの係数の増分
+#endif
+#ifndef KEYBALL_FILTER_DEADZONE
+#    define KEYBALL_FILTER_DEADZONE 3 // 静止状態から動き出したとみなす移動量 (0で無効)
+#endif
+#ifndef KEYBALL_FILTER_IDLE_TIMEOUT
+#    define KEYBALL_FILTER_IDLE_TIMEOUT 50 // フレームがこの時間(ms)途切れたら静止状態に戻る
+#endif
+
+/// SQUAL(センサーが捉えた表面の特徴の数/4)がこれ未満のフレームの動きは捨てる (0で無効)
+#ifndef KEYBALL_SQUAL_MIN
+#    define KEYBALL_SQUAL_MIN 10
+#endif
+
+/// スプリットの通信の統計をコンソールに出力する間隔(ms) (0で無効)
+/// フラッシュを使うので、診断する時だけconfig.hで5000などにする。
+#ifndef KEYBALL_LINK_PRINT_INTERVAL
+#    define KEYBALL_LINK_PRINT_INTERVAL 0
+#endif
+
+/// 表面の状態の統計をコンソールに出力する間隔(ms) (0で無効)
+/// フラッシュを使うので、診断する時だけconfig.hで5000などにする。
+#ifndef KEYBALL_SURFACE_PRINT_INTERVAL
+#    define KEYBALL_SURFACE_PRINT_INTERVAL 0
 #endif
 
 /// スクロールスナップ機能を無効化する場合、config.hに0を定義
@@ -45,6 +132,52 @@ Copyright 2022 MURAOKA Taro (aka KoRoN)
 #    define KEYBALL_SCROLLSNAP_TENSION_THRESHOLD 12 // スクロールスナップのテンション閾値
 #endif
 
+/// 自動スナップ: 軸を決めるまでに貯める動きの量(カウント、スクロール除数適用前)
+#ifndef KEYBALL_SCROLLSNAP_AUTO_WINDOW
+#    define KEYBALL_SCROLLSNAP_AUTO_WINDOW 16
+#endif
+
+/// 自動スナップ: ロック中の軸を切り替えるには、もう一方の軸の動きがこの倍数を超える必要がある
+#ifndef KEYBALL_SCROLLSNAP_AUTO_RATIO
+#    define KEYBALL_SCROLLSNAP_AUTO_RATIO 3
+#endif
+
+/// 自動スナップ: この時間(ms)動きがなければ軸のロックを解除する
+#ifndef KEYBALL_SCROLLSNAP_AUTO_TIMEOUT
+#    define KEYBALL_SCROLLSNAP_AUTO_TIMEOUT 200
+#endif
+
+/// センサーのレストモード(無操作時にフレームレートを下げる省電力機能)を
+/// 起動時に有効にする場合、config.hに1を定義
+#ifndef KEYBALL_PMW3360_REST_ENABLE
+#    define KEYBALL_PMW3360_REST_ENABLE 0
+#endif
+
+// レストモードのタイミング (デフォルトはデータシートの初期値)
+#ifndef KEYBALL_PMW3360_RUN_DOWNSHIFT
+#    define KEYBALL_PMW3360_RUN_DOWNSHIFT 50 // Run→Rest1までの時間 (x10ms)
+#endif
+#ifndef KEYBALL_PMW3360_REST1_RATE
+#    define KEYBALL_PMW3360_REST1_RATE 0 // Rest1のフレーム周期 (+1ms)
+#endif
+#ifndef KEYBALL_PMW3360_REST1_DOWNSHIFT
+#    define KEYBALL_PMW3360_REST1_DOWNSHIFT 31 // Rest1→Rest2までの時間 (x320フレーム)
+#endif
+#ifndef KEYBALL_PMW3360_REST2_RATE
+#    define KEYBALL_PMW3360_REST2_RATE 99 // Rest2のフレーム周期 (+1ms)
+#endif
+#ifndef KEYBALL_PMW3360_REST2_DOWNSHIFT
+#    define KEYBALL_PMW3360_REST2_DOWNSHIFT 188 // Rest2→Rest3までの時間 (x32フレーム)
+#endif
+#ifndef KEYBALL_PMW3360_REST3_RATE
+#    define KEYBALL_PMW3360_REST3_RATE 499 // Rest3のフレーム周期 (+1ms)
+#endif
+
+/// USBサスペンド中にセンサーをシャットダウンしない場合、config.hに0を定義
+#ifndef KEYBALL_PMW3360_SHUTDOWN_ON_SUSPEND
+#    define KEYBALL_PMW3360_SHUTDOWN_ON_SUSPEND 1
+#endif
+
 /// 特定のレイヤーでズーム機能を有効にするためのレイヤー番号
 #ifndef KEYBALL_ZOOM_LAYER
 #    define KEYBALL_ZOOM_LAYER 1
@@ -56,6 +189,21 @@ Copyright 2022 MURAOKA Taro (aka KoRoN)
 #define KEYBALL_TX_GETINFO_INTERVAL 500
 #define KEYBALL_TX_GETINFO_MAXTRY 10
 #define KEYBALL_TX_GETMOTION_INTERVAL 4
+/// セカンダリのボールが止まっている間、動きを問い合わせる間隔(ms)
+#define KEYBALL_TX_GETMOTION_IDLE_INTERVAL 16
+
+/// 交渉後のトランザクションがこの回数続けて失敗したら、セカンダリとの接続が切れたとみなす
+#define KEYBALL_TX_LINK_LOSS_FAILURES 8
+/// 接続が切れた後に交渉をやり直す間隔(ms)。失敗するたびに倍にし、最大値で止める。
+#define KEYBALL_TX_RENEGOTIATE_MIN 50
+#define KEYBALL_TX_RENEGOTIATE_MAX 4000
+
+/// スプリットのバッチ転送(KEYBALL_BATCH)の要求/応答の最大バイト数。
+/// QMKのRPC_M2S_BUFFER_SIZE/RPC_S2M_BUFFER_SIZE以下にすること。
+#define KEYBALL_BATCH_SIZE 28
+
+/// マスターの状態をセカンダリに複製する最短の間隔(ms)。変化がなければ送らない。
+#define KEYBALL_TX_STATE_INTERVAL 100
 
 #if (PRODUCT_ID & 0xff00) == 0x0000
 #    define KEYBALL_MODEL 46
@@ -93,6 +241,13 @@ enum keyball_keycodes {
     SSNP_HOR = QK_KB_14, // スクロールスナップモードを水平に設定
     SSNP_FRE = QK_KB_15, // スクロールスナップモードを無効化 (フリースクロール)
 
+    KBC_LCAL = QK_KB_16, // リフトカットオフの較正を開始/終了して結果を保存
+
+    ACC_NEXT = QK_KB_17, // 次の加速度プロファイルに切り替え
+    RPT_NEXT = QK_KB_18, // 次のマウスレポートレートに切り替え (125/250/500/1000Hz)
+
+    SSNP_AUT = QK_KB_19, // スクロールスナップモードを自動 (動きから軸を判定) に設定
+
     // オートマウスレイヤー制御用キーコード
     // POINTING_DEVICE_AUTO_MOUSE_ENABLEが定義されている場合のみ有効
     AML_TO   = QK_KB_10, // オートマウスレイヤーのトグル
@@ -107,7 +262,7 @@ typedef union {
     uint32_t raw;
     struct {
         uint8_t cpi : 7;      // CPI値
-        uint8_t sdiv : 3;     // スクロール除数
+        uint8_t sdiv : 3;     // スクロール除数 (2の乗数の段階, 古いファームウェア用)
 #ifdef POINTING_DEVICE_AUTO_MOUSE_ENABLE
         uint8_t amle : 1;     // オートマウスレイヤーの有効化
         uint16_t amlto : 5;   // オートマウスレイヤーのタイムアウト
@@ -115,9 +270,40 @@ typedef union {
 #if KEYBALL_SCROLLSNAP_ENABLE == 2
         uint8_t ssnap : 2;    // スクロールスナップモード
 #endif
+        uint8_t lcut : 8;     // リフトカットオフの較正値 (0: 未較正)
     };
 } keyball_config_t;
 
+/// ボールの向きの設定。センサーの取り付け向きに対する補正として適用される。
+typedef struct {
+    int16_t angle;      // 回転角度 (度, 画面上で時計回りが正)
+    uint8_t mirror : 1; // 左右反転
+    uint8_t snap : 1;   // センサーのAngle_Snap (直線的な動きへの補正)
+} keyball_orient_t;
+
+/// EEPROMのキーボード用データブロックに保存する設定。
+/// keyball_config_tに収まらない設定を置く。全て0が初期値となるようにすること。
+typedef struct {
+    keyball_orient_t orient[2]; // ボールの向き ([0]: 右側, [1]: 左側)
+    uint8_t accel;              // 加速度プロファイル (0: デフォルト, それ以外: 番号+1)
+    uint8_t rate;               // マウスレポートレート (0: デフォルト, それ以外: 値+1)
+    uint8_t sdiv_h;             // 水平スクロール除数 (0: 垂直と同じ)
+    uint8_t sdiv;               // スクロール除数 (0: keyball_config_tのsdivから読み替え)
+} keyball_datablock_t;
+
+/// ボールの向きから事前計算した軸の変換
+typedef struct {
+    bool   swap; // X軸とY軸の入れ替え
+    int8_t sx;   // 入れ替え後のXの符号
+    int8_t sy;   // 入れ替え後のYの符号
+} keyball_xform_t;
+
+/// センサーのAngle_Tune/Angle_Snapに設定する値
+typedef struct {
+    int8_t tune; // 回転角度 (度)
+    bool   snap; // Angle_Snapの有効化
+} keyball_angle_t;
+
 typedef struct {
     uint8_t ballcnt; // ボールの数: 現在は0または1のみ対応
 } keyball_info_t;
@@ -127,14 +313,138 @@ typedef struct {
     int16_t y;
 } keyball_motion_t;
 
+/// KEYBALL_TLV_MOTIONの応答の末尾に付けるフラグ
+typedef enum {
+    KEYBALL_MOTION_FLAG_MOVED = 1, // この応答に動きがある
+    KEYBALL_MOTION_FLAG_MORE  = 2, // 8ビットに収まらず、セカンダリに動きが残っている
+} keyball_motion_flag_t;
+
+/// スプリットのバッチ転送に載せるTLVの種類
+typedef enum {
+    KEYBALL_TLV_END    = 0, // 終端
+    KEYBALL_TLV_INFO   = 1, // 要求: なし, 応答: keyball_info_t (起動後に一度も要求されていなければ要求がなくても返す)
+    KEYBALL_TLV_MOTION = 2, // 要求: 1軸のバイト数(1 or 2), 応答: keyball_motion8_t or keyball_motion_t と keyball_motion_flag_t(1バイト)
+    KEYBALL_TLV_CPI    = 3, // 要求: keyball_cpi_t, 応答: なし
+    KEYBALL_TLV_ANGLE  = 4, // 要求: keyball_angle_t, 応答: なし
+    KEYBALL_TLV_STATE  = 5, // 要求: 変化したフィールドのマスク(1バイト)とkeyball_state_tのそのフィールド, 応答: なし
+    KEYBALL_TLV_SUSPEND = 6, // 要求: 1バイト(1: サスペンド, 0: 復帰), 応答: なし
+    KEYBALL_TLV_LIFT_CAL = 7, // 要求: 1バイト(1: 較正の開始, 0: 終了), 応答: なし
+} keyball_tlv_type_t;
+
+/// マスターからセカンダリに複製する状態。セカンダリのOLEDはこれを表示する。
+/// 変化したフィールドだけを送るので、フィールドを足す時はkeyball.cのstate_fieldsにも足すこと。
+typedef struct {
+    uint8_t os;          // ホストOS (os_variant_t)
+    struct {
+        bool    scroll : 1; // スクロールモード
+        uint8_t ssnap : 2;  // スクロールスナップモード
+        bool    amle : 1;   // オートマウスレイヤーの有効化
+        uint8_t sdiv : 4;   // スクロール除数 (0: デフォルト)
+    } modes;
+    uint8_t layer;       // レイヤーの状態 (下位8レイヤー)
+    uint8_t cpi;         // CPI値 (0: デフォルト)
+    uint8_t aml_timeout; // オートマウスレイヤーのタイムアウト(10ms単位)
+    struct {
+        int16_t x;
+        int16_t y;
+        int8_t  h;
+        int8_t  v;
+    } mouse;             // 最後のマウスレポート
+} keyball_state_t;
+
+/// 小さな動きをセカンダリから送る時の形式
+typedef struct {
+    int8_t x;
+    int8_t y;
+} keyball_motion8_t;
+
+/// ポインター移動で次のレポートに持ち越す量
+typedef struct {
+    keyball_motion_t rem;    // 加速度を掛けた結果の端数 (1/256単位)
+    keyball_motion_t excess; // レポートの範囲(±127)を超えて送れなかった量
+} keyball_carry_t;
+
+/// モーションフィルターの状態
+typedef struct {
+    keyball_motion_t hist[2]; // 中央値フィルター用の直前2フレーム
+    keyball_motion_t lp;      // ローパスフィルターの出力 (1/16単位)
+    keyball_motion_t rem;     // ローパスの出力を整数にした端数 (1/16単位)
+    keyball_motion_t owed;    // 中央値とローパスで遅らせていて、まだ出していない動き
+    keyball_motion_t pending; // 静止状態で溜めている動き (静止状態に戻っても持ち越す)
+    bool             running; // フレームを受け取っていて、まだ静止状態に戻っていない
+    bool             active;  // デッドゾーンを超えて動いている
+    uint32_t         last_us; // 最後にフレームを受け取った時刻(us)
+} keyball_filter_t;
+
+/// ボールの表面の状態の統計。ボールやベアリングの汚れの目安になる。
+typedef struct {
+    uint16_t squal;   // SQUALの移動平均 (1/16単位)
+    uint16_t shutter; // シャッター時間の移動平均 (暗い・汚れているほど長い)
+    uint16_t frames;  // 読み取ったフレーム数
+    uint16_t gated;   // SQUALが低いため捨てたフレーム数
+} keyball_surface_t;
+
+/// スプリットの通信(keyballのトランザクション)の統計。マスターでのみ数える。
+typedef struct {
+    uint32_t attempts;      // 試行回数
+    uint32_t failures;      // 失敗回数
+    uint32_t retries;       // 失敗の直後の試行回数
+    uint16_t rtt_min;       // 往復時間の最小(us)
+    uint16_t rtt_avg;       // 往復時間の移動平均(us)
+    uint16_t rtt_max;       // 往復時間の最大(us)
+    uint16_t bytes_per_sec; // 直近1秒に送受信したペイロードのバイト数
+} keyball_link_stats_t;
+
+/// 慣性スクロールの状態
+typedef struct {
+    int32_t  vh;         // 水平スクロール速度 (1msあたりのホイール単位, 1/4096単位)
+    int32_t  vv;         // 垂直スクロール速度 (同上)
+    int16_t  rem_h;      // 送りきれなかった水平の端数 (ホイール単位の1/4096)
+    int16_t  rem_v;      // 送りきれなかった垂直の端数 (同上)
+    uint32_t last_us;    // 前回処理した時刻(us)
+    uint32_t contact_us; // 最後にボールが動いていた時刻(us)
+    bool     coasting;   // 慣性スクロール中
+} keyball_kinetic_t;
+
+/// 加速度の計算に使うボールの速度
+typedef struct {
+    uint32_t last_us; // 前回速度を計算したフレームの時刻(us)
+    uint16_t speed;   // 平滑化した速度 (500CPIで8msあたりのカウント数, 1/16単位)
+} keyball_velocity_t;
+
 typedef uint8_t keyball_cpi_t;
 
+typedef enum {
+    KEYBALL_REPORT_RATE_125HZ  = 0, // 8ms間隔
+    KEYBALL_REPORT_RATE_250HZ  = 1, // 4ms間隔
+    KEYBALL_REPORT_RATE_500HZ  = 2, // 2ms間隔
+    KEYBALL_REPORT_RATE_1000HZ = 3, // 1ms間隔
+} keyball_report_rate_t;
+
+/// ボールの動きの適用先の状態。
+/// 切替直後の遷移中は動きを保留し、保留時間が過ぎたら切替後のモードで、同じ時間をかけて送る。
+typedef enum {
+    KEYBALL_MOTION_MODE_POINTER    = 0, // ポインター
+    KEYBALL_MOTION_MODE_SCROLL     = 1, // スクロール
+    KEYBALL_MOTION_MODE_TO_POINTER = 2, // スクロールからポインターへの遷移中
+    KEYBALL_MOTION_MODE_TO_SCROLL  = 3, // ポインターからスクロールへの遷移中
+} keyball_motion_mode_t;
+
 typedef enum {
     KEYBALL_SCROLLSNAP_MODE_VERTICAL   = 0, // 垂直スクロールスナップ
     KEYBALL_SCROLLSNAP_MODE_HORIZONTAL = 1, // 水平スクロールスナップ
     KEYBALL_SCROLLSNAP_MODE_FREE       = 2, // フリースクロール
+    KEYBALL_SCROLLSNAP_MODE_AUTO       = 3, // 動きから軸を判定してスナップ
 } keyball_scrollsnap_mode_t;
 
+/// 自動スクロールスナップの状態
+typedef struct {
+    uint16_t acc_h;   // 水平方向の動きの累積 (減衰あり)
+    uint16_t acc_v;   // 垂直方向の動きの累積 (減衰あり)
+    uint32_t last;    // 最後に動いた時刻(ms)
+    keyball_scrollsnap_mode_t axis; // ロック中の軸 (FREE: 未決定)
+} keyball_snap_t;
+
 typedef struct {
     bool this_have_ball;                  // プライマリボールの有無
     bool that_enable;                     // セカンダリの有効化
@@ -142,13 +452,57 @@ typedef struct {
 
     keyball_motion_t this_motion;         // プライマリの動き
     keyball_motion_t that_motion;         // セカンダリの動き
+    uint8_t          that_motion_width;   // 次にセカンダリの動きを受け取る1軸あたりのバイト数 (1 or 2)
+    bool             that_motion_active;  // 直前の応答でセカンダリのボールが動いていた (問い合わせの間隔を詰める)
+    keyball_filter_t this_filter;         // プライマリの動きのフィルター
+    keyball_carry_t  move_carry[2];       // ポインター移動の持ち越し ([0]: 右側, [1]: 左側)
+#if KEYBALL_KINETIC_SCROLL_ENABLE
+    keyball_kinetic_t kinetic[2];         // 慣性スクロール ([0]: 右側, [1]: 左側)
+#endif
+    keyball_carry_t  scroll_carry[2];     // スクロールの持ち越し ([0]: 右側, [1]: 左側, x: 水平, y: 垂直)
+    uint32_t         frame_us[2];         // 最後に動きを読み取った時刻(us) ([0]: 右側, [1]: 左側)
+    keyball_velocity_t velocity[2];       // ボールの速度 ([0]: 右側, [1]: 左側)
 
     uint8_t cpi_value;                    // CPI値
     bool    cpi_changed;                  // CPI変更フラグ
+    bool    this_cpi_pending;             // プライマリのセンサーにCPIを未反映
+
+    uint8_t accel_profile;                // 加速度プロファイル (0: デフォルト, それ以外: 番号+1)
+
+    uint8_t  report_rate;                 // マウスレポートレート (0: デフォルト, それ以外: 値+1)
+    uint32_t motion_last;                 // 最後に動きがあった時刻
+
+    uint32_t key_us;                      // 最後にキーの状態が変化した時刻(us)
+    uint32_t report_us;                   // 最後にマウスレポートを作成した時刻(us)
+
+    bool rest_mode;                       // センサーのレストモードの有効化
+    bool this_rest_pending;               // プライマリのセンサーにレストモードを未反映
+
+    keyball_orient_t orient[2];           // ボールの向き ([0]: 右側, [1]: 左側)
+    keyball_xform_t  xform[2];            // 向きから計算した軸の変換 ([0]: 右側, [1]: 左側)
+    keyball_angle_t  this_angle;          // プライマリのセンサーに設定する角度
+    bool             that_angle_changed;  // セカンダリの角度変更フラグ
+    bool             this_angle_pending;  // プライマリのセンサーに角度を未反映
+
+    bool    suspended;                    // USBサスペンド中 (セカンダリ: マスターから複製)
+    bool    that_suspended;               // セカンダリに送ったサスペンド状態
+
+    bool    this_lifted;                  // プライマリボールのリフト検出
+    keyball_surface_t this_surface;       // プライマリボールの表面の状態
+    uint8_t lift_cutoff;                  // リフトカットオフの較正値 (0: 未較正)
+    bool    lift_calibrating;             // リフトカットオフの較正中
+    bool    lift_cal_target;              // リフトカットオフの較正の要求 (セカンダリ: マスターから複製)
+    bool    that_lift_cal;                // セカンダリに送った較正の要求
+    bool    lift_cutoff_dirty;            // 較正値をEEPROMに未保存
 
     bool     scroll_mode;                 // スクロールモードの有効化
-    uint32_t scroll_mode_changed;         // スクロールモード変更時刻
-    uint8_t  scroll_div;                  // スクロール除数
+    keyball_motion_mode_t motion_mode;    // 動きの適用先の状態
+    uint32_t motion_mode_changed;         // スクロールモード変更時刻
+    keyball_motion_t held[2];             // 遷移中に溜めて、まだ送っていない動き ([0]: 右側, [1]: 左側)
+    uint32_t held_last;                   // heldを最後に送った時刻
+    uint32_t held_until;                  // heldを送りきる時刻
+    uint8_t  scroll_div;                  // スクロール除数 (垂直)
+    uint8_t  scroll_div_h;                // 水平スクロール除数 (0: 垂直と同じ)
 
     uint8_t  scroll_reverse_mode;         // スクロール方向の逆転(OSで切り替える用)
 
@@ -157,11 +511,14 @@ typedef struct {
     int8_t   scroll_snap_tension_h;       // スクロールスナップのテンション (水平)
 #elif KEYBALL_SCROLLSNAP_ENABLE == 2
     keyball_scrollsnap_mode_t scrollsnap_mode; // 現在のスクロールスナップモード
+    keyball_snap_t scrollsnap_auto[2];    // 自動スナップの状態 ([0]: 右側, [1]: 左側)
 #endif
 
     uint16_t       last_kc;                // 最後のキーコード
     keypos_t       last_pos;               // 最後のキー位置
     report_mouse_t last_mouse;             // 最後のマウスレポート
+    keyball_state_t shared_state;          // マスター: 最後に複製した状態, セカンダリ: 複製された状態
+    keyball_link_stats_t link;             // スプリットの通信の統計
 
     // 押下中のキーを示すバッファ
     char pressing_keys[KEYBALL_OLED_MAX_PRESSING_KEYCODES + 1];
@@ -204,10 +561,23 @@ void keyball_on_apply_motion_to_mouse_zoom(keyball_motion_t *m, bool is_left);
 //////////////////////////////////////////////////////////////////////////////
 // 公開API関数
 
+/// keyball_timer_usはマイクロ秒単位の時刻を返します。
+/// 約71分で一周するので、差分だけを使ってください。
+/// AVRではタイマーのハードウェアカウンター、ホスト上ではOSの時計を使います。
+uint32_t keyball_timer_us(void);
+
 /// keyball_oled_render_ballinfoはボール情報をOLEDに表示します。
 /// 21列のみを使用して情報を表示します。
 void keyball_oled_render_ballinfo(void);
 
+/// keyball_oled_render_ballsubinfoはプライマリボールの表面の状態をOLEDに表示します。
+/// SQUALとシャッター時間の移動平均、SQUALが低く捨てたフレームの割合(%)を表示します。
+void keyball_oled_render_ballsubinfo(void);
+
+/// keyball_oled_render_linkinfoはスプリットの通信の状態をOLEDに表示します。
+/// 失敗率(%)、往復時間の移動平均(us)、1秒あたりのバイト数を表示します。
+void keyball_oled_render_linkinfo(void);
+
 /// keyball_oled_render_keyinfoは最後に処理されたキー情報をOLEDに表示します。
 /// 列、行、キーコード、キー名（利用可能な場合）を表示します。
 void keyball_oled_render_keyinfo(void);
@@ -220,26 +590,81 @@ void keyball_oled_render_layerinfo(void);
 bool keyball_get_scroll_mode(void);
 
 /// keyball_set_scroll_modeはスクロールモードを変更します。
+/// キーコード(SCRL_MO, SCRL_TO)やレイヤーによる切替はすべてこれを通します。
 void keyball_set_scroll_mode(bool mode);
 
+/// keyball_get_motion_modeはボールの動きの適用先の状態(遷移中を含む)を取得します。
+keyball_motion_mode_t keyball_get_motion_mode(void);
+
 /// keyball_get_scrollsnap_modeは現在のスクロールスナップモードを取得します。
 keyball_scrollsnap_mode_t keyball_get_scrollsnap_mode(void);
 
 /// keyball_set_scrollsnap_modeはスクロールスナップモードを変更します。
 void keyball_set_scrollsnap_mode(keyball_scrollsnap_mode_t mode);
 
-/// keyball_get_scroll_divは現在のスクロール除数を取得します。
+/// keyball_get_scroll_divは現在のスクロール除数の段階を取得します。
+/// 段階は1〜13で、2段階ごとに除数が2倍 (1: 1/1, 7: 1/8, 13: 1/64) になります。
 uint8_t keyball_get_scroll_div(void);
 
-/// keyball_set_scroll_divはスクロール除数を変更します。
+/// keyball_set_scroll_divはスクロール除数の段階を変更します。
 void keyball_set_scroll_div(uint8_t div);
 
+/// keyball_get_scroll_div_hは現在の水平スクロール除数を取得します。
+uint8_t keyball_get_scroll_div_h(void);
+
+/// keyball_set_scroll_div_hは水平スクロール除数を変更します。0で垂直と同じになります。
+void keyball_set_scroll_div_h(uint8_t div);
+
 /// keyball_get_cpiは現在のトラックボールのCPIを取得します。
 uint8_t keyball_get_cpi(void);
 
 /// keyball_set_cpiはトラックボールのCPIを変更します。
 void keyball_set_cpi(uint8_t cpi);
 
+/// keyball_get_accel_profileは現在の加速度プロファイルの番号を取得します。
+uint8_t keyball_get_accel_profile(void);
+
+/// keyball_set_accel_profileは加速度プロファイルを変更します。
+/// 番号はKEYBALL_ACCEL_PROFILESに並べた順で、範囲外の場合は最後のプロファイルになります。
+void keyball_set_accel_profile(uint8_t profile);
+
+/// keyball_get_report_rateは操作中のマウスレポートレートを取得します。
+keyball_report_rate_t keyball_get_report_rate(void);
+
+/// keyball_set_report_rateは操作中のマウスレポートレートを変更します。
+/// USBのエンドポイントのポーリング間隔(USB_POLLING_INTERVAL_MS)より速くはならないので、
+/// 1000Hzにはconfig.hで1msにしておく必要があります(各モデルのconfig.hでは1ms)。
+/// 無操作がKEYBALL_REPORT_IDLE_TIMEOUT続いた後の最初の動きは、間隔を待たずにすぐ送ります。
+void keyball_set_report_rate(keyball_report_rate_t rate);
+
+/// keyball_get_link_statsはスプリットの通信の統計を取得します。
+/// マスターでのみ数え、セカンダリやスプリットでないモデルでは0のままです。
+keyball_link_stats_t keyball_get_link_stats(void);
+
+/// keyball_get_rest_modeはセンサーのレストモードが有効かどうかを取得します。
+bool keyball_get_rest_mode(void);
+
+/// keyball_set_rest_modeはセンサーのレストモードを変更します。
+/// 有効にすると無操作時にフレームレートを段階的に下げて消費電力を抑えます。
+void keyball_set_rest_mode(bool enable);
+
+/// keyball_get_orientationは左側(is_left=true)または右側のボールの向きを取得します。
+keyball_orient_t keyball_get_orientation(bool is_left);
+
+/// keyball_set_orientationは左側(is_left=true)または右側のボールの向きを変更します。
+/// 90度単位の回転と左右反転はソフトウェアで、残りの±30度まではセンサーの
+/// Angle_Tuneで補正します。KBC_SAVEでEEPROMに保存されます。
+void keyball_set_orientation(bool is_left, keyball_orient_t orient);
+
+/// keyball_get_lift_calibratingはリフトカットオフの較正中かどうかを取得します。
+bool keyball_get_lift_calibrating(void);
+
+/// keyball_set_lift_calibratingはリフトカットオフの較正を開始/終了します。
+/// 開始後、ボールをベアリング上で様々な方向に転がしてから終了してください。
+/// 終了時に結果がセンサーに適用され、ボールのある側のEEPROMに保存されます。
+/// ボールがセカンダリにあれば、マスターから要求を送ります。
+void keyball_set_lift_calibrating(bool start);
+
 /// keyball_get_scroll_reverse_modeは現在のスクロール方向を取得します。
 uint8_t keyball_get_scroll_reverse_mode(void);
 
@@ -0,0 +1,134 @@
+// Minimal stand-in for QMK's quantum.h, enough to build keyball.c on the
+// host for tests.  Only declarations keyball.c uses are here; the test
+// program defines the functions it actually calls.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#define PROGMEM
+#define PSTR(x) x
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define F_CPU 16000000UL
+#define PRODUCT_ID 0x0200
+#define B6 6
+#define QK_KB_0 0x7e00
+#define QK_KB_1 0x7e01
+#define QK_KB_2 0x7e02
+#define QK_KB_3 0x7e03
+#define QK_KB_4 0x7e04
+#define QK_KB_5 0x7e05
+#define QK_KB_6 0x7e06
+#define QK_KB_7 0x7e07
+#define QK_KB_8 0x7e08
+#define QK_KB_9 0x7e09
+#define QK_KB_10 0x7e0a
+#define QK_KB_11 0x7e0b
+#define QK_KB_12 0x7e0c
+#define QK_KB_13 0x7e0d
+#define QK_KB_14 0x7e0e
+#define QK_KB_15 0x7e0f
+#define QK_KB_16 0x7e10
+#define QK_KB_17 0x7e11
+#define QK_KB_18 0x7e12
+#define QK_KB_19 0x7e13
+#define QK_KB_20 0x7e14
+#define QK_KB_21 0x7e15
+#define QK_KB_22 0x7e16
+#define QK_KB_23 0x7e17
+#define QK_KB_24 0x7e18
+#define QK_KB_25 0x7e19
+#define QK_KB_26 0x7e1a
+#define QK_KB_27 0x7e1b
+#define QK_KB_28 0x7e1c
+#define QK_KB_29 0x7e1d
+#define QK_KB_30 0x7e1e
+#define QK_KB_31 0x7e1f
+#define QK_USER_0 0x7e40
+#define QK_MODS 0x0100
+#define QK_MODS_MAX 0x1fff
+#define KC_MS_BTN1 0xd1
+#define KC_MS_BTN8 0xd8
+#define AUTO_MOUSE_TIME 650
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#define TIMER_DIFF_32(a,b) ((uint32_t)((a)-(b)))
+#define TIMER_DIFF_16(a,b) ((uint16_t)((a)-(b)))
+#define ATOMIC_BLOCK_FORCEON for(int _i=0;_i<1;_i++)
+#define dprintf(...) printf(__VA_ARGS__)
+#define uprintf(...) printf(__VA_ARGS__)
+#define xprintf(...) printf(__VA_ARGS__)
+#define setPinOutput(p) (void)(p)
+#ifdef MOUSE_EXTENDED_REPORT
+typedef int16_t mouse_xy_report_t;
+#else
+typedef int8_t mouse_xy_report_t;
+#endif
+typedef struct { uint8_t buttons;
+mouse_xy_report_t x, y;
+int8_t v, h;
+} report_mouse_t;
+typedef struct { uint8_t col, row;
+} keypos_t;
+typedef struct { keypos_t key;
+bool pressed;
+uint16_t time;
+} keyevent_t;
+typedef struct { keyevent_t event;
+} keyrecord_t;
+typedef uint8_t layer_state_t;
+typedef uint8_t deferred_token;
+typedef uint32_t (*deferred_exec_callback)(uint32_t, void*);
+deferred_token defer_exec(uint32_t, deferred_exec_callback, void*);
+bool cancel_deferred_exec(deferred_token);
+#define INVALID_DEFERRED_TOKEN 0
+uint32_t timer_read32(void);
+uint16_t timer_read(void);
+void wait_us(uint32_t);
+void wait_ms(uint32_t);
+bool is_keyboard_master(void);
+bool is_keyboard_left(void);
+uint32_t eeconfig_read_kb(void);
+void eeconfig_update_kb(uint32_t);
+bool eeconfig_is_enabled(void);
+uint32_t eeconfig_read_user(void);
+bool layer_state_is(uint8_t);
+uint8_t get_highest_layer(layer_state_t);
+extern layer_state_t layer_state;
+void oled_write_P(const char*, bool);
+void oled_write(const char*, bool);
+void oled_write_char(char, bool);
+void oled_advance_page(bool);
+void oled_write_ln_P(const char*, bool);
+void oled_write_ln(const char*, bool);
+bool get_auto_mouse_enable(void);
+void set_auto_mouse_enable(bool);
+uint16_t get_auto_mouse_timeout(void);
+void set_auto_mouse_timeout(uint16_t);
+bool is_mouse_record_user(uint16_t, keyrecord_t*);
+bool process_record_user(uint16_t, keyrecord_t*);
+void keyboard_post_init_user(void);
+void keyboard_pre_init_user(void);
+uint32_t via_get_layout_options(void);
+void via_set_layout_options(uint32_t);
+bool pointing_device_send(void);
+report_mouse_t pointing_device_get_report(void);
+void pointing_device_set_report(report_mouse_t);
+extern bool debug_enable;
+typedef enum { OLED_ROTATION_0, OLED_ROTATION_180 } oled_rotation_t;
+void suspend_power_down_user(void);
+void suspend_wakeup_init_user(void);
+#ifndef EECONFIG_KB_DATA_SIZE
+#define EECONFIG_KB_DATA_SIZE 16
+#endif
+void eeconfig_read_kb_datablock(void *data);
+void eeconfig_update_kb_datablock(const void *data);
+#ifndef MATRIX_ROWS
+#define MATRIX_ROWS 8
+#define MATRIX_COLS 6
+#endif
+typedef uint8_t matrix_row_t;
+void matrix_scan_user(void);
+void matrix_slave_scan_user(void);
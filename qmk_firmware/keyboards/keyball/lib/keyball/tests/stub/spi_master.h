@@ -0,0 +1,15 @@
+// Minimal stand-in for QMK's spi_master.h, for pmw3360.h on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef int16_t spi_status_t;
+typedef uint8_t pin_t;
+
+void         spi_init(void);
+bool         spi_start(pin_t slavePin, bool lsbFirst, uint8_t mode, uint16_t divisor);
+spi_status_t spi_write(uint8_t data);
+spi_status_t spi_read(void);
+spi_status_t spi_receive(uint8_t *data, uint16_t length);
+void         spi_stop(void);
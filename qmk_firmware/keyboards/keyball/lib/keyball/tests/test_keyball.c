@@ -0,0 +1,583 @@
+/*
+Copyright 2022 MURAOKA Taro (aka KoRoN)
+
+このプログラムはフリーソフトウェアです。GNU一般公衆利用許諾契約書の第2版、
+またはそれ以降のバージョンの条件の下で再配布や改変が可能です。
+
+このプログラムは有用であることを願って提供されていますが、
+商品性や特定目的への適合性についての明示的または黙示的な保証はありません。
+詳細についてはGNU一般公衆利用許諾契約書を参照してください。
+
+このプログラムのコピーは、GNUのウェブサイト<http://www.gnu.org/licenses/>から入手できます。
+*/
+
+// keyball.cの動きの計算をホスト上で確かめるテスト。
+// static関数を直接呼べるよう、keyball.cをそのまま取り込む。
+
+#include "keyball.c"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                            \
+    do                                                                            \
+    {                                                                             \
+        long _a = (long)(a), _b = (long)(b);                                      \
+        if (_a != _b)                                                             \
+        {                                                                         \
+            printf("%s:%d: %s == %s: %ld != %ld\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+            failures++;                                                           \
+        }                                                                         \
+    } while (0)
+
+////////////////////////////////////////////////////////////////////////////////
+// QMKの代わり
+
+layer_state_t layer_state = 0;
+
+// テストが進めるミリ秒タイマー
+static uint32_t fake_ms = 0;
+
+uint32_t timer_read32(void)
+{
+    return fake_ms;
+}
+
+bool is_keyboard_master(void)
+{
+    return true;
+}
+
+bool is_keyboard_left(void)
+{
+    return false;
+}
+
+bool eeconfig_is_enabled(void)
+{
+    return false;
+}
+
+uint32_t eeconfig_read_kb(void)
+{
+    return 0;
+}
+
+void eeconfig_update_kb(uint32_t val)
+{
+}
+
+void eeconfig_read_kb_datablock(void *data)
+{
+}
+
+void eeconfig_update_kb_datablock(const void *data)
+{
+}
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record)
+{
+    return true;
+}
+
+void register_mouse(uint8_t mouse_keycode, bool pressed)
+{
+}
+
+void suspend_power_down_user(void)
+{
+}
+
+void suspend_wakeup_init_user(void)
+{
+}
+
+void oled_write(const char *data, bool invert)
+{
+}
+
+void oled_write_P(const char *data, bool invert)
+{
+}
+
+void oled_write_char(const char data, bool invert)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// センサーの代わり
+
+bool pmw3360_angle_set(int8_t deg, bool snap)
+{
+    return true;
+}
+
+bool pmw3360_async_busy(void)
+{
+    return false;
+}
+
+bool pmw3360_cpi_set(uint8_t cpi)
+{
+    return true;
+}
+
+bool pmw3360_init_async(pmw3360_init_cb_t done)
+{
+    return true;
+}
+
+bool pmw3360_lift_cal_start(void)
+{
+    return true;
+}
+
+bool pmw3360_lift_cal_stop(pmw3360_read_cb_t cb)
+{
+    return true;
+}
+
+bool pmw3360_lift_cutoff_set(uint8_t tune)
+{
+    return true;
+}
+
+// 次のpmw3360_motion_burstが返すフレーム。一度返したら動きなしに戻る。
+static pmw3360_motion_t fake_frame = {0};
+
+bool pmw3360_motion_burst(pmw3360_motion_t *d)
+{
+    *d         = fake_frame;
+    fake_frame = (pmw3360_motion_t){0};
+    return (d->motion & pmw3360_MOTION_MOT) != 0;
+}
+
+bool pmw3360_probe(void)
+{
+    return true;
+}
+
+bool pmw3360_rest_set(bool enable, const pmw3360_rest_t *rest)
+{
+    return true;
+}
+
+bool pmw3360_shutdown(void)
+{
+    return true;
+}
+
+void pmw3360_task(void)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ポインター移動
+
+// 記録したジェスチャー: 1フレーム(1ms)ごとのセンサーのカウント。
+// 微小な動きから始まり、レポートに収まらない速さまで加速して止まり、逆向きにも動く。
+// 手で動かせる速さの変化なので、フィルターが突発的な値とみなすフレームはない。
+static const keyball_motion_t gesture[] = {
+    {1, 0},     {0, 1},     {1, 1},     {-1, 0},    {2, 1},    {3, -1},   {5, 2},    {8, 3},
+    {13, 5},    {21, 8},    {34, 13},   {55, 21},   {80, 30},  {100, 40}, {120, 48}, {120, 48},
+    {120, 48},  {100, 40},  {80, 30},   {55, -21},  {34, -13}, {21, -8},  {13, -5},  {8, -3},
+    {5, -2},    {3, -1},    {2, -1},    {1, 0},     {-1, 1},   {0, -1},   {-30, 4},  {-60, 8},
+    {-90, 12},  {-60, 8},   {-30, 4},   {-7, 3},    {-3, 1},   {-1, 0},
+};
+
+#define GESTURE_LEN (sizeof(gesture) / sizeof(gesture[0]))
+
+// mul_q88は端数を持ち越すので、どんなゲインでも
+// 出力の合計 * 256 + 残りの端数 == 入力 * ゲインの合計
+// が厳密に成り立つ。
+static void test_mul_q88_carry(void)
+{
+    static const uint16_t gains[] = {26, 100, 255, 256, 257, 600, 768, 1024};
+    for (uint8_t g = 0; g < sizeof(gains) / sizeof(gains[0]); g++)
+    {
+        int16_t rem_x = 0, rem_y = 0;
+        int32_t out_x = 0, out_y = 0;
+        int32_t in_x = 0, in_y = 0;
+        for (uint8_t i = 0; i < GESTURE_LEN; i++)
+        {
+            out_x += mul_q88(gesture[i].x, gains[g], &rem_x);
+            out_y += mul_q88(gesture[i].y, gains[g], &rem_y);
+            in_x += (int32_t)gesture[i].x * gains[g];
+            in_y += (int32_t)gesture[i].y * gains[g];
+            CHECK(rem_x > -256 && rem_x < 256);
+            CHECK(rem_y > -256 && rem_y < 256);
+        }
+        CHECK_EQ(out_x * 256 + rem_x, in_x);
+        CHECK_EQ(out_y * 256 + rem_y, in_y);
+    }
+}
+
+// 加速なしのプロファイルでは、レポートに送ったカウントの合計はセンサーのカウントの合計と一致する。
+// センサーのフレームをpointing_device_driver_get_reportに通し、フィルター、加速度、
+// レポートに収まらない分の持ち越しまでを確かめる。
+// フィルターが遅らせた分は止まった後に、レポートに収まらない分はその後のレポートで送りきる。
+static void test_move_sums(void)
+{
+    memset(&keyball, 0, sizeof(keyball));
+    keyball.this_have_ball = true;
+    keyball_set_accel_profile(0);
+    keyball.xform[0] = (keyball_xform_t){.swap = false, .sx = 1, .sy = 1};
+
+    int32_t sensor_x = 0, sensor_y = 0;
+    int32_t sent_x = 0, sent_y = 0;
+    bool    clipped = false;
+    for (uint16_t i = 0; i < 500; i++)
+    {
+        fake_ms = 1000 + i;
+        if (i < GESTURE_LEN)
+        {
+            fake_frame = (pmw3360_motion_t){
+                .motion = pmw3360_MOTION_MOT,
+                .x      = gesture[i].x,
+                .y      = gesture[i].y,
+                .squal  = 64,
+            };
+            sensor_x += gesture[i].x;
+            sensor_y += gesture[i].y;
+        }
+        report_mouse_t r = pointing_device_driver_get_report((report_mouse_t){0});
+        CHECK(r.x >= -127 && r.x <= 127);
+        CHECK(r.y >= -127 && r.y <= 127);
+        clipped |= keyball.move_carry[0].excess.x != 0;
+        sent_x += r.x;
+        sent_y += r.y;
+    }
+    // ジェスチャーがフィルターの送りきりと持ち越しの経路を通ったことを確かめる
+    CHECK(clipped);
+    CHECK(!keyball.this_filter.running);
+    CHECK_EQ(keyball.move_carry[0].excess.x, 0);
+    CHECK_EQ(keyball.move_carry[0].excess.y, 0);
+    CHECK_EQ(sent_x, sensor_x);
+    CHECK_EQ(sent_y, sensor_y);
+    fake_ms = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// モーションフィルター
+
+// filter_runは1msごとのフレームをフィルターに通し、止まった後の送りきりも含めて
+// 出した動きの合計を返します。
+static keyball_motion_t filter_run(keyball_filter_t *f, uint32_t start_us, const keyball_motion_t *frames, uint8_t len)
+{
+    keyball_motion_t out = {0};
+    uint32_t         now = start_us;
+    for (uint8_t i = 0; i < len; i++, now += 1000)
+    {
+        int16_t x = frames[i].x, y = frames[i].y;
+        filter_motion(f, &x, &y, now);
+        out.x += x;
+        out.y += y;
+    }
+    // 止まった直後はまだ送らず、静止状態に戻る時に送りきる
+    int16_t x, y;
+    CHECK(!filter_flush(f, &x, &y, now + KEYBALL_FILTER_IDLE_TIMEOUT * 1000UL - 1000));
+    filter_flush(f, &x, &y, now + KEYBALL_FILTER_IDLE_TIMEOUT * 1000UL);
+    out.x += x;
+    out.y += y;
+    return out;
+}
+
+// 遅い動きも速い動きも、フィルターの出力の合計はセンサーのカウントの合計と一致する
+static void test_filter_sums(void)
+{
+    keyball_motion_t slow2[20], slow1[10];
+    for (uint8_t i = 0; i < 20; i++)
+    {
+        slow2[i] = (keyball_motion_t){2, 0};
+    }
+    for (uint8_t i = 0; i < 10; i++)
+    {
+        slow1[i] = (keyball_motion_t){0, 1};
+    }
+    static const keyball_motion_t flick[] = {
+        {1, 0}, {3, 1}, {6, 2}, {10, 4}, {14, 5}, {16, 6}, {14, 5}, {11, 4}, {8, 3}, {5, 2}, {3, 1}, {2, 0}, {1, 0},
+    };
+    keyball_filter_t f;
+    keyball_motion_t out;
+
+    memset(&f, 0, sizeof(f));
+    out = filter_run(&f, 0, slow2, 20);
+    CHECK_EQ(out.x, 40);
+    CHECK_EQ(out.y, 0);
+
+    memset(&f, 0, sizeof(f));
+    out = filter_run(&f, 0, slow1, 10);
+    CHECK_EQ(out.x, 0);
+    CHECK_EQ(out.y, 10);
+
+    memset(&f, 0, sizeof(f));
+    out = filter_run(&f, 0, flick, sizeof(flick) / sizeof(flick[0]));
+    CHECK_EQ(out.x, 94);
+    CHECK_EQ(out.y, 33);
+    CHECK(!f.running);
+    CHECK_EQ(f.owed.x, 0);
+}
+
+// 1フレームだけ飛び出した値は、その値だけが捨てられる
+static void test_filter_spike(void)
+{
+    static const keyball_motion_t frames[] = {{5, 0}, {5, 0}, {300, 0}, {5, 0}, {5, 0}};
+    keyball_filter_t f = {0};
+    keyball_motion_t out = filter_run(&f, 0, frames, sizeof(frames) / sizeof(frames[0]));
+    CHECK_EQ(out.x, 5 * 5);
+}
+
+// 静止中のノイズはデッドゾーンで止まりレポートを出さないが、捨てずに次の動きに持ち越す
+static void test_filter_deadzone_carry(void)
+{
+    static const keyball_motion_t jitter[] = {{1, 0}, {-1, 0}, {1, 0}, {0, 1}, {0, -1}, {1, 0}};
+    static const keyball_motion_t move[]   = {{2, 0}, {2, 0}, {2, 0}, {2, 0}};
+    keyball_filter_t f = {0};
+    uint32_t         now = 0;
+    for (uint8_t i = 0; i < sizeof(jitter) / sizeof(jitter[0]); i++, now += 1000)
+    {
+        int16_t x = jitter[i].x, y = jitter[i].y;
+        CHECK(!filter_motion(&f, &x, &y, now));
+    }
+    int16_t x, y;
+    CHECK(!filter_flush(&f, &x, &y, now + KEYBALL_FILTER_IDLE_TIMEOUT * 1000UL));
+    CHECK(!f.running);
+    keyball_motion_t out = filter_run(&f, 1000000, move, sizeof(move) / sizeof(move[0]));
+    CHECK_EQ(out.x, 2 + 8);
+    CHECK_EQ(out.y, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// スクロール
+
+// 半オクターブの段階では除数が分数になるが、端数を持ち越すので
+// 送ったホイールの単位の合計は カウントの合計 * 16 / 除数(Q4) の切り捨てになる。
+static void test_scroll_fractional_div(void)
+{
+    for (uint8_t div = 1; div <= SCROLL_DIV_MAX; div++)
+    {
+        memset(&keyball, 0, sizeof(keyball));
+        keyball.xform[0] = (keyball_xform_t){.swap = false, .sx = 1, .sy = 1};
+        keyball_set_scrollsnap_mode(KEYBALL_SCROLLSNAP_MODE_VERTICAL);
+        keyball_set_scroll_div(div);
+
+        int32_t counts = 0, units = 0;
+        for (uint16_t i = 0; i < 1000; i++)
+        {
+            keyball_motion_t m = {.x = 0, .y = -(int16_t)(i % 5)};
+            counts += i % 5;
+            report_mouse_t r = {0};
+            keyball_on_apply_motion_to_mouse_scroll(&m, &r, false);
+            units += r.v;
+        }
+        CHECK_EQ(units, counts * 16 / scroll_div_q4[div - 1]);
+    }
+    // 奇数番目の段階は以前の2の乗数の除数と同じ
+    for (uint8_t n = 1; n <= 7; n++)
+    {
+        CHECK_EQ(scroll_div_q4[n * 2 - 2], 16 << (n - 1));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 自動スクロールスナップ
+
+// 記録したトレースの1フレーム: 画面上の動きと時刻(ms)、その後に期待する軸
+typedef struct {
+    int16_t  h;
+    int16_t  v;
+    uint32_t now;
+    keyball_scrollsnap_mode_t want;
+} snap_frame_t;
+
+#define FREE KEYBALL_SCROLLSNAP_MODE_FREE
+#define VERT KEYBALL_SCROLLSNAP_MODE_VERTICAL
+#define HORI KEYBALL_SCROLLSNAP_MODE_HORIZONTAL
+
+static void check_trace(const char *name, const snap_frame_t *trace, uint8_t len)
+{
+    keyball_snap_t s = {.axis = FREE};
+    for (uint8_t i = 0; i < len; i++)
+    {
+        keyball_scrollsnap_mode_t got = snap_auto(&s, trace[i].h, trace[i].v, trace[i].now);
+        if (got != trace[i].want)
+        {
+            printf("%s: frame %u: axis %d, want %d\n", name, i, got, trace[i].want);
+            failures++;
+            return;
+        }
+    }
+}
+
+#define CHECK_TRACE(t) check_trace(#t, t, sizeof(t) / sizeof(t[0]))
+
+// 少し斜めに動き出しても、貯めた量が多い垂直にロックする
+static const snap_frame_t trace_lock_vertical[] = {
+    {1, -3, 0, FREE}, {0, -4, 8, FREE}, {1, -4, 16, FREE}, {0, -5, 24, VERT}, {2, -6, 32, VERT},
+};
+
+// 水平も同じ
+static const snap_frame_t trace_lock_horizontal[] = {
+    {3, 1, 0, FREE}, {-4, 0, 8, FREE}, {5, -1, 16, FREE}, {4, 0, 24, HORI}, {6, 1, 32, HORI},
+};
+
+// ロック後は、もう一方の軸の動きが一時的に上回っても切り替えない。
+// もう一方の軸が十分に優勢になって初めて切り替える。
+static const snap_frame_t trace_hysteresis[] = {
+    {0, 8, 0, FREE}, {0, 8, 8, VERT},
+    // 斜めの手の揺れ: 水平が垂直を上回るが比率に届かない
+    {3, 2, 16, VERT}, {3, 2, 24, VERT}, {3, 2, 32, VERT}, {3, 2, 40, VERT}, {3, 2, 48, VERT}, {3, 2, 56, VERT},
+    {3, 2, 64, VERT}, {3, 2, 72, VERT}, {3, 2, 80, VERT}, {3, 2, 88, VERT}, {3, 2, 96, VERT}, {3, 2, 104, VERT},
+    // 水平だけの動きが続けば切り替わる
+    {12, 0, 112, VERT}, {12, 0, 120, VERT}, {12, 0, 128, VERT}, {12, 0, 136, HORI}, {12, 1, 144, HORI}, {12, 1, 152, HORI},
+};
+
+// 一定時間動きがなければロックを解除し、次の動きで軸を決め直す
+static const snap_frame_t trace_timeout[] = {
+    {0, 9, 0, FREE}, {0, 9, 8, VERT},
+    {0, 0, 8 + KEYBALL_SCROLLSNAP_AUTO_TIMEOUT - 1, VERT},
+    {0, 0, 8 + KEYBALL_SCROLLSNAP_AUTO_TIMEOUT, FREE},
+    {9, 0, 300, FREE}, {9, 0, 308, HORI},
+};
+
+static void test_snap_auto_traces(void)
+{
+    CHECK_TRACE(trace_lock_vertical);
+    CHECK_TRACE(trace_lock_horizontal);
+    CHECK_TRACE(trace_hysteresis);
+    CHECK_TRACE(trace_timeout);
+}
+
+// 軸が決まるまでのスクロールは送らずに持ち越し、ロックした時にその軸の分だけまとめて送る
+static void test_snap_auto_release(void)
+{
+    memset(&keyball, 0, sizeof(keyball));
+    keyball.xform[0] = (keyball_xform_t){.swap = false, .sx = 1, .sy = 1};
+    keyball_set_scrollsnap_mode(KEYBALL_SCROLLSNAP_MODE_AUTO);
+    keyball_set_scroll_div(1);
+
+    static const keyball_motion_t frames[] = {{2, -3}, {1, -4}, {0, -5}, {1, -6}, {0, -2}};
+    int32_t counts = 0, units_v = 0, units_h = 0;
+    for (uint8_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+    {
+        fake_ms = 1000 + i * 8;
+        keyball_motion_t m = frames[i];
+        counts -= m.y;
+        report_mouse_t r = {0};
+        keyball_on_apply_motion_to_mouse_scroll(&m, &r, false);
+        if (i < 3)
+        {
+            // 3フレーム目までの累積は 水平3 + 垂直12 < 16 で、まだ未決定
+            CHECK_EQ(r.v, 0);
+            CHECK_EQ(keyball.scrollsnap_auto[0].axis, FREE);
+        }
+        else if (i == 3)
+        {
+            // ロックしたフレームで、貯めていた垂直の分を全て送る
+            CHECK_EQ(keyball.scrollsnap_auto[0].axis, VERT);
+            CHECK_EQ(r.v, 3 + 4 + 5 + 6);
+        }
+        units_v += r.v;
+        units_h += r.h;
+    }
+    CHECK_EQ(units_v, counts);
+    // 水平の揺れは捨てられる
+    CHECK_EQ(units_h, 0);
+    CHECK_EQ(keyball.scroll_carry[0].excess.x, 0);
+    fake_ms = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// スクロールモードの切替
+
+// 持ち越した量は捨てずに切替後のモードの単位に読み替え、戻せば元に戻る
+static void test_mode_switch_carry(void)
+{
+    memset(&keyball, 0, sizeof(keyball));
+    keyball.this_have_ball = true;
+    keyball_set_scroll_div(1);
+    keyball.xform[0] = (keyball_xform_t){.swap = true, .sx = -1, .sy = 1};
+    keyball.move_carry[0].excess = (keyball_motion_t){40, -30};
+
+    keyball_set_scroll_mode(true);
+    // 画面上では右に30、下に40なので、水平に30、垂直に-40ノッチ
+    CHECK_EQ(keyball.scroll_carry[0].excess.x, 30);
+    CHECK_EQ(keyball.scroll_carry[0].excess.y, -40);
+    CHECK_EQ(keyball.move_carry[0].excess.x, 0);
+    CHECK_EQ(keyball.move_carry[0].excess.y, 0);
+
+    keyball_set_scroll_mode(false);
+    CHECK_EQ(keyball.move_carry[0].excess.x, 40);
+    CHECK_EQ(keyball.move_carry[0].excess.y, -30);
+    CHECK_EQ(keyball.scroll_carry[0].excess.x, 0);
+    CHECK_EQ(keyball.scroll_carry[0].excess.y, 0);
+}
+
+// 遷移中に溜めた動きは、保留が明けた瞬間にまとめてではなく、溜めたのと同じ時間をかけて送る
+static void test_mode_switch_release(void)
+{
+    memset(&keyball, 0, sizeof(keyball));
+    keyball.this_have_ball = true;
+    keyball_set_accel_profile(0);
+    keyball.xform[0] = (keyball_xform_t){.swap = false, .sx = 1, .sy = 1};
+    keyball.scroll_mode = true;
+    keyball.motion_mode = KEYBALL_MOTION_MODE_SCROLL;
+
+    fake_ms = 1000;
+    keyball_set_scroll_mode(false);
+    int32_t sent = 0, first = 0;
+    uint8_t reports = 0;
+    for (uint16_t i = 0; i < 200; i++)
+    {
+        fake_ms = 1000 + i;
+        if (i < KEYBALL_TRANSITION_TO_POINTER)
+        {
+            fake_frame = (pmw3360_motion_t){.motion = pmw3360_MOTION_MOT, .x = 2, .squal = 64};
+        }
+        report_mouse_t r = pointing_device_driver_get_report((report_mouse_t){0});
+        if (i < KEYBALL_TRANSITION_TO_POINTER)
+        {
+            CHECK_EQ(r.x, 0);
+        }
+        if (r.x != 0)
+        {
+            first = reports == 0 ? r.x : first;
+            reports++;
+        }
+        sent += r.x;
+    }
+    CHECK_EQ(sent, 2 * KEYBALL_TRANSITION_TO_POINTER);
+    CHECK(first <= sent / 4);
+    CHECK(reports >= 5);
+    fake_ms = 0;
+}
+
+int main(void)
+{
+    test_mul_q88_carry();
+    test_move_sums();
+    test_filter_sums();
+    test_filter_spike();
+    test_filter_deadzone_carry();
+    test_scroll_fractional_div();
+    test_snap_auto_traces();
+    test_snap_auto_release();
+    test_mode_switch_carry();
+    test_mode_switch_release();
+    if (failures > 0)
+    {
+        printf("FAIL: %d\n", failures);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
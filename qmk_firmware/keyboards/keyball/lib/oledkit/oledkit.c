@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "quantum.h"
 
 #ifdef OLED_ENABLE
+extern void keyball_oled_render_ballinfo(void);
+extern void keyball_oled_render_layerinfo(void);
 extern void keyball_oled_render_osinfo(void);
 #endif
 
@@ -46,6 +48,9 @@ __attribute__((weak)) bool oled_task_user(void) {
     } else {
         // oledkit_render_logo_user();
         // oled_advance_page(false);      // ロゴ表示後に改行して
+        // マスターから複製された状態を表示する
+        keyball_oled_render_ballinfo();
+        keyball_oled_render_layerinfo();
         keyball_oled_render_osinfo();    // OS情報を追加表示する
     }
     return true;
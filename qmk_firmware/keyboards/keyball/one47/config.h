@@ -54,6 +54,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #    define LAYER_STATE_8BIT
 #endif
 
+// EEPROM datablock for Keyball's settings which don't fit in 32 bits
+// (keyball_datablock_t)
+#define EECONFIG_KB_DATA_SIZE 16
+
 // To squeeze firmware size
 #undef LOCKING_SUPPORT_ENABLE
 #undef LOCKING_RESYNC_ENABLE